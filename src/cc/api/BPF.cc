@@ -26,6 +26,11 @@
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -71,6 +76,27 @@ bool uprobe_ref_ctr_supported() {
   }
   return false;
 }
+
+// Runs job(0) ... job(n - 1) on up to max_threads threads, or one per CPU if
+// max_threads is 0. The calling thread takes a share of the jobs too.
+void run_parallel(size_t n, unsigned max_threads,
+                  const std::function<void(size_t)>& job) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++)
+      job(i);
+  };
+
+  if (max_threads == 0)
+    max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t nthreads = std::min<size_t>(max_threads, n);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads)
+    t.join();
+}
 } // namespace
 
 namespace ebpf {
@@ -129,9 +155,66 @@ StatusTuple BPF::init(const std::string& bpf_program,
     return StatusTuple(-1, "Unable to initialize BPF program");
   }
 
+  for (const auto& u : usdt_) {
+    auto& probe = *static_cast<::USDT::Probe*>(u.probe_.get());
+    if (!probe.has_location_table())
+      continue;
+    int fd = bpf_module_->table_fd(probe.location_table_name());
+    if (fd < 0 || !probe.fill_location_table(fd)) {
+      StatusTuple res(-1, "Unable to fill location table of USDT %s",
+                      u.print_name().c_str());
+      init_fail_reset();
+      return res;
+    }
+  }
+
   return StatusTuple::OK();
 };
 
+StatusTuple BPF::save_object(const std::string& path,
+                             const std::string& bpf_program,
+                             const std::vector<std::string>& cflags) {
+  auto flags_len = cflags.size();
+  const char* flags[flags_len];
+  for (size_t i = 0; i < flags_len; i++)
+    flags[i] = cflags[i].c_str();
+
+  if (bpf_module_->save_object(path, bpf_program, flags, flags_len) != 0)
+    return StatusTuple(-1, "Unable to save BPF program to %s", path.c_str());
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::load_object(const std::string& path) {
+  if (bpf_module_->load_object(path) != 0)
+    return StatusTuple(-1, "Unable to load BPF object %s", path.c_str());
+  return StatusTuple::OK();
+}
+
+std::vector<StatusTuple> BPF::init_all(const std::vector<BPF*>& bpfs,
+                                       const std::vector<InitSpec>& specs,
+                                       unsigned max_threads) {
+  std::vector<StatusTuple> res(bpfs.size(), StatusTuple::OK());
+  if (bpfs.size() != specs.size()) {
+    for (auto& r : res)
+      r = StatusTuple(-1, "Got %zu BPF objects for %zu programs", bpfs.size(),
+                      specs.size());
+    return res;
+  }
+
+  run_parallel(bpfs.size(), max_threads, [&](size_t i) {
+    const InitSpec& spec = specs[i];
+    bpfs[i]->bpf_module_->use_private_table_storage();
+    res[i] = bpfs[i]->init(spec.program, spec.cflags, spec.usdt);
+    for (auto& f : spec.funcs) {
+      if (res[i].code() != 0)
+        break;
+      int fd;
+      res[i] = bpfs[i]->load_func(f.first, f.second, fd);
+    }
+  });
+  return res;
+}
+
 BPF::~BPF() {
   auto res = detach_all();
   if (res.code() != 0)
@@ -191,6 +274,15 @@ StatusTuple BPF::detach_all() {
     delete it.second;
   }
 
+  if (ring_buffer_) {
+    auto res = ring_buffer_->close();
+    if (res.code() != 0) {
+      error_msg += "Failed to close ring buffer: " + res.msg() + "\n";
+      has_error = true;
+    }
+    ring_buffer_.reset();
+  }
+
   for (auto& it : perf_event_arrays_) {
     auto res = it.second->close_all_cpu();
     if (res.code() != 0) {
@@ -236,6 +328,7 @@ StatusTuple BPF::attach_kprobe(const std::string& kernel_func,
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_KPROBE, probe_fd));
 
+  PhaseTimer timer("attach", probe_event);
   int res_fd = bpf_attach_kprobe(probe_fd, attach_type, probe_event.c_str(),
                                  kernel_func.c_str(), kernel_func_offset,
                                  maxactive);
@@ -279,6 +372,7 @@ StatusTuple BPF::attach_uprobe(const std::string& binary_path,
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_KPROBE, probe_fd));
 
+  PhaseTimer timer("attach", probe_event);
   int res_fd = bpf_attach_uprobe(probe_fd, attach_type, probe_event.c_str(),
                                  binary_path.c_str(), offset, pid,
                                  ref_ctr_offset);
@@ -371,6 +465,7 @@ StatusTuple BPF::attach_tracepoint(const std::string& tracepoint,
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_TRACEPOINT, probe_fd));
 
+  PhaseTimer timer("attach", tracepoint);
   int res_fd =
       bpf_attach_tracepoint(probe_fd, tp_category.c_str(), tp_name.c_str());
 
@@ -395,6 +490,7 @@ StatusTuple BPF::attach_raw_tracepoint(const std::string& tracepoint, const std:
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_RAW_TRACEPOINT, probe_fd));
 
+  PhaseTimer timer("attach", tracepoint);
   int res_fd = bpf_attach_raw_tracepoint(probe_fd, tracepoint.c_str());
 
   if (res_fd < 0) {
@@ -422,6 +518,7 @@ StatusTuple BPF::attach_perf_event(uint32_t ev_type, uint32_t ev_config,
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_PERF_EVENT, probe_fd));
 
+  PhaseTimer timer("attach", probe_func);
   std::vector<int> cpus;
   if (cpu >= 0)
     cpus.push_back(cpu);
@@ -463,6 +560,7 @@ StatusTuple BPF::attach_perf_event_raw(void* perf_event_attr,
   int probe_fd;
   TRY2(load_func(probe_func, BPF_PROG_TYPE_PERF_EVENT, probe_fd));
 
+  PhaseTimer timer("attach", probe_func);
   std::vector<int> cpus;
   if (cpu >= 0)
     cpus.push_back(cpu);
@@ -631,10 +729,8 @@ StatusTuple BPF::close_perf_event(const std::string& name) {
   return StatusTuple::OK();
 }
 
-StatusTuple BPF::open_perf_buffer(const std::string& name,
-                                  perf_reader_raw_cb cb,
-                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
-                                  int page_cnt) {
+StatusTuple BPF::new_perf_buffer(const std::string& name, int page_cnt,
+                                 BPFPerfBuffer** table) {
   if (perf_buffers_.find(name) == perf_buffers_.end()) {
     TableStorage::iterator it;
     if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
@@ -645,8 +741,32 @@ StatusTuple BPF::open_perf_buffer(const std::string& name,
   }
   if ((page_cnt & (page_cnt - 1)) != 0)
     return StatusTuple(-1, "open_perf_buffer page_cnt must be a power of two");
-  auto table = perf_buffers_[name];
-  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt));
+  *table = perf_buffers_[name];
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_perf_buffer(const std::string& name,
+                                  perf_reader_raw_cb cb,
+                                  perf_reader_lost_cb lost_cb, void* cb_cookie,
+                                  int page_cnt, int wakeup_events,
+                                  int wakeup_watermark) {
+  BPFPerfBuffer* table;
+  TRY2(new_perf_buffer(name, page_cnt, &table));
+  TRY2(table->open_all_cpu(cb, lost_cb, cb_cookie, page_cnt, wakeup_events,
+                           wakeup_watermark));
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::open_perf_buffer_batch(const std::string& name,
+                                        perf_reader_batch_cb cb,
+                                        perf_reader_lost_cb lost_cb,
+                                        void* cb_cookie, int page_cnt,
+                                        int wakeup_events,
+                                        int wakeup_watermark) {
+  BPFPerfBuffer* table;
+  TRY2(new_perf_buffer(name, page_cnt, &table));
+  TRY2(table->open_all_cpu_batch(cb, lost_cb, cb_cookie, page_cnt,
+                                 wakeup_events, wakeup_watermark));
   return StatusTuple::OK();
 }
 
@@ -670,6 +790,43 @@ int BPF::poll_perf_buffer(const std::string& name, int timeout_ms) {
   return it->second->poll(timeout_ms);
 }
 
+StatusTuple BPF::open_ring_buffer(const std::string& name,
+                                  ring_buffer_sample_fn cb, void* cb_cookie) {
+  TableStorage::iterator it;
+  if (!bpf_module_->table_storage().Find(Path({bpf_module_->id(), name}), it))
+    return StatusTuple(-1, "open_ring_buffer: unable to find table_storage %s",
+                       name.c_str());
+  if (ring_buffer_)
+    return ring_buffer_->add(it->second, cb, cb_cookie);
+
+  std::unique_ptr<BPFRingBuffer> ring_buffer(new BPFRingBuffer(it->second));
+  TRY2(ring_buffer->open(cb, cb_cookie));
+  ring_buffer_ = std::move(ring_buffer);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::close_ring_buffer() {
+  if (!ring_buffer_)
+    return StatusTuple(-1, "Ring buffer not open");
+  TRY2(ring_buffer_->close());
+  ring_buffer_.reset();
+  return StatusTuple::OK();
+}
+
+BPFRingBuffer* BPF::get_ring_buffer() { return ring_buffer_.get(); }
+
+int BPF::poll_ring_buffer(int timeout_ms) {
+  if (!ring_buffer_)
+    return -1;
+  return ring_buffer_->poll(timeout_ms);
+}
+
+int BPF::consume_ring_buffer() {
+  if (!ring_buffer_)
+    return -1;
+  return ring_buffer_->consume();
+}
+
 StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
                            int& fd, unsigned flags) {
   if (funcs_.find(func_name) != funcs_.end()) {
@@ -677,6 +834,54 @@ StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
     return StatusTuple::OK();
   }
 
+  TRY2(load_func_fd(func_name, type, fd, flags));
+  funcs_[func_name] = fd;
+  return StatusTuple::OK();
+}
+
+StatusTuple BPF::load_all_funcs(
+    const std::function<bpf_prog_type(const std::string&)>& type_resolver,
+    std::vector<FuncLoadInfo>* info, unsigned max_threads) {
+  std::vector<FuncLoadInfo> loads;
+  for (size_t i = 0; i < bpf_module_->num_functions(); i++) {
+    FuncLoadInfo load;
+    load.name = bpf_module_->function_name(i);
+    load.type = type_resolver(load.name);
+    if (load.type == BPF_PROG_TYPE_UNSPEC)
+      continue;
+    load.insn_cnt =
+        bpf_module_->function_size(load.name) / sizeof(struct bpf_insn);
+    auto it = funcs_.find(load.name);
+    if (it != funcs_.end())
+      load.fd = it->second;
+    loads.push_back(load);
+  }
+
+  run_parallel(loads.size(), max_threads, [&](size_t i) {
+    FuncLoadInfo& load = loads[i];
+    if (load.fd >= 0)
+      return;
+    auto start = std::chrono::steady_clock::now();
+    load.status = load_func_fd(load.name, load.type, load.fd, 0);
+    load.load_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  });
+
+  StatusTuple res = StatusTuple::OK();
+  for (auto& load : loads) {
+    if (load.status.code() == 0)
+      funcs_[load.name] = load.fd;
+    else if (res.code() == 0)
+      res = load.status;
+  }
+  if (info)
+    *info = std::move(loads);
+  return res;
+}
+
+StatusTuple BPF::load_func_fd(const std::string& func_name, bpf_prog_type type,
+                              int& fd, unsigned flags) {
   uint8_t* func_start = bpf_module_->function_start(func_name);
   if (!func_start)
     return StatusTuple(-1, "Can't find start of function %s",
@@ -701,7 +906,6 @@ StatusTuple BPF::load_func(const std::string& func_name, bpf_prog_type type,
       func_name, fd, reinterpret_cast<struct bpf_insn*>(func_start), func_size);
   if (ret < 0)
     fprintf(stderr, "WARNING: cannot get prog tag, ignore saving source with program tag\n");
-  funcs_[func_name] = fd;
   return StatusTuple::OK();
 }
 
@@ -721,6 +925,7 @@ StatusTuple BPF::unload_func(const std::string& func_name) {
 StatusTuple BPF::attach_func(int prog_fd, int attachable_fd,
                              enum bpf_attach_type attach_type,
                              uint64_t flags) {
+  PhaseTimer timer("attach");
   int res = bpf_module_->bcc_func_attach(prog_fd, attachable_fd, attach_type, flags);
   if (res != 0)
     return StatusTuple(-1, "Can't attach for prog_fd %d, attachable_fd %d, "
@@ -930,6 +1135,11 @@ int BPF::free_bcc_memory() {
   return bcc_free_memory();
 }
 
+void BPF::compact(CompactStats* stats) {
+  std::string().swap(all_bpf_program_);
+  bpf_module_->compact(stats);
+}
+
 USDT::USDT(const std::string& binary_path, const std::string& provider,
            const std::string& name, const std::string& probe_func)
     : initialized_(false),
@@ -1012,24 +1222,18 @@ StatusTuple USDT::init() {
     return StatusTuple(-1, "Unable to load USDT " + print_name());
 
   auto deleter = [](void* probe) { delete static_cast<::USDT::Probe*>(probe); };
-  for (auto& p : ctx->probes_) {
-    if (p->provider_ == provider_ && p->name_ == name_) {
-      // Take ownership of the probe that we are interested in, and avoid it
-      // being destructed when we destruct the USDT::Context instance
-      probe_ = std::unique_ptr<void, std::function<void(void*)>>(p.release(),
-                                                                 deleter);
-      p.swap(ctx->probes_.back());
-      ctx->probes_.pop_back();
-      break;
-    }
-  }
+  // Take ownership of the probe that we are interested in, and avoid it
+  // being destructed when we destruct the USDT::Context instance
+  if (auto p = ctx->release(provider_, name_))
+    probe_ = std::unique_ptr<void, std::function<void(void*)>>(p.release(),
+                                                               deleter);
   if (!probe_)
     return StatusTuple(-1, "Unable to find USDT " + print_name());
   ctx.reset(nullptr);
   auto& probe = *static_cast<::USDT::Probe*>(probe_.get());
 
   std::ostringstream stream;
-  if (!probe.usdt_getarg(stream, probe_func_))
+  if (!probe.usdt_getarg(stream, probe_func_, true))
     return StatusTuple(
         -1, "Unable to generate program text for USDT " + print_name());
   program_text_ = ::USDT::USDT_PROGRAM_HEADER + stream.str();
@@ -18,6 +18,7 @@
 
 #include <cctype>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <ostream>
 #include <string>
@@ -28,6 +29,7 @@
 #include "bpf_module.h"
 #include "linux/bpf.h"
 #include "libbpf.h"
+#include "phase_stats.h"
 #include "table_storage.h"
 
 static const int DEFAULT_PERF_BUFFER_PAGE_CNT = 8;
@@ -60,6 +62,37 @@ class BPF {
 
   StatusTuple init_usdt(const USDT& usdt);
 
+  // Compiles bpf_program like init(), but writes the result to path instead
+  // of loading it, see BPFModule::save_object(). The BPF object can't be used
+  // for anything else afterwards.
+  StatusTuple save_object(const std::string& path,
+                          const std::string& bpf_program,
+                          const std::vector<std::string>& cflags = {});
+  // Initializes from an object written by save_object() instead of compiling
+  // a program, after which the BPF object is used as if init() had been
+  // called with that program.
+  StatusTuple load_object(const std::string& path);
+
+  // A program for init_all(): the arguments to init(), and the functions to
+  // load once it has been compiled.
+  struct InitSpec {
+    std::string program;
+    std::vector<std::string> cflags;
+    std::vector<USDT> usdt;
+    std::vector<std::pair<std::string, bpf_prog_type>> funcs;
+  };
+
+  // Initializes bpfs[i] from specs[i] for each i, compiling and loading the
+  // programs concurrently on up to max_threads threads, or one per online
+  // CPU if max_threads is 0. Every BPF compiles in its own LLVM context.
+  // BPF objects constructed without a TableStorage keep their tables in
+  // storage of their own, as the process-wide one can't be used from several
+  // threads, so tables they export are not visible to other BPF objects.
+  // Returns the status of each BPF, in order.
+  static std::vector<StatusTuple> init_all(const std::vector<BPF*>& bpfs,
+                                           const std::vector<InitSpec>& specs,
+                                           unsigned max_threads = 0);
+
   ~BPF();
   StatusTuple detach_all();
 
@@ -224,10 +257,24 @@ class BPF {
   // Open a Perf Buffer of given name, providing callback and callback cookie
   // to use when polling. BPF class owns the opened Perf Buffer and will free
   // it on-demand or on destruction.
+  // By default the poller is woken up for every sample. Passing
+  // wakeup_events > 1, or a wakeup_watermark in bytes, batches wakeups; polls
+  // then flush pending samples on timeout, so use a finite timeout.
   StatusTuple open_perf_buffer(const std::string& name, perf_reader_raw_cb cb,
                                perf_reader_lost_cb lost_cb = nullptr,
                                void* cb_cookie = nullptr,
-                               int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT);
+                               int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT,
+                               int wakeup_events = 1,
+                               int wakeup_watermark = 0);
+  // Same as above, but samples are delivered to cb in batches that point
+  // directly into the perf ring buffer; they are only valid during the call.
+  StatusTuple open_perf_buffer_batch(const std::string& name,
+                                     perf_reader_batch_cb cb,
+                                     perf_reader_lost_cb lost_cb = nullptr,
+                                     void* cb_cookie = nullptr,
+                                     int page_cnt = DEFAULT_PERF_BUFFER_PAGE_CNT,
+                                     int wakeup_events = 1,
+                                     int wakeup_watermark = 0);
   // Close and free the Perf Buffer of given name.
   StatusTuple close_perf_buffer(const std::string& name);
   // Obtain an pointer to the opened BPFPerfBuffer instance of given name.
@@ -241,10 +288,53 @@ class BPF {
   //   number of CPUs that have new data, otherwise.
   int poll_perf_buffer(const std::string& name, int timeout_ms = -1);
 
+  // Open a Ring Buffer of given name, providing callback and callback cookie
+  // to use when polling. All Ring Buffers opened on a BPF instance are served
+  // by a single epoll, so one poll_ring_buffer() call consumes records from
+  // every one of them. BPF class owns the Ring Buffers and will free them
+  // on-demand or on destruction.
+  StatusTuple open_ring_buffer(const std::string& name,
+                               ring_buffer_sample_fn cb,
+                               void* cb_cookie = nullptr);
+  // Close and free all opened Ring Buffers.
+  StatusTuple close_ring_buffer();
+  // Obtain a pointer to the BPFRingBuffer instance serving all opened Ring
+  // Buffers. Will return nullptr if no Ring Buffer has been opened.
+  BPFRingBuffer* get_ring_buffer();
+  // Poll the opened Ring Buffers with given timeout, using the callbacks
+  // provided when opening. Returns:
+  //   -1 on error or if no ring buffer has been opened;
+  //   number of records consumed, otherwise.
+  int poll_ring_buffer(int timeout_ms = -1);
+  // Consume records available in the opened Ring Buffers without waiting.
+  int consume_ring_buffer();
+
   StatusTuple load_func(const std::string& func_name, enum bpf_prog_type type,
                         int& fd, unsigned flags = 0);
   StatusTuple unload_func(const std::string& func_name);
 
+  // Outcome of loading one function with load_all_funcs().
+  struct FuncLoadInfo {
+    std::string name;
+    bpf_prog_type type = BPF_PROG_TYPE_UNSPEC;
+    StatusTuple status = StatusTuple::OK();
+    int fd = -1;
+    // Number of instructions submitted to the verifier.
+    size_t insn_cnt = 0;
+    // Time spent in the program load, i.e. mostly in the verifier. Zero
+    // for functions that had already been loaded.
+    uint64_t load_ns = 0;
+  };
+
+  // Loads every function in the module, with the type type_resolver returns
+  // for its name, concurrently on up to max_threads threads (one per CPU if
+  // 0). Functions it maps to BPF_PROG_TYPE_UNSPEC are skipped. Loaded
+  // functions are then available through load_func() as usual. Returns the
+  // first failure; if info is given it receives an entry per function.
+  StatusTuple load_all_funcs(
+      const std::function<bpf_prog_type(const std::string&)>& type_resolver,
+      std::vector<FuncLoadInfo>* info = nullptr, unsigned max_threads = 0);
+
   StatusTuple attach_func(int prog_fd, int attachable_fd,
                           enum bpf_attach_type attach_type,
                           uint64_t flags);
@@ -253,12 +343,25 @@ class BPF {
 
   int free_bcc_memory();
 
+  // Drops the compiler state and sources once all functions are loaded,
+  // see BPFModule::compact(). Tables are still accessible with their typed
+  // accessors, but not as strings through get_table().
+  void compact(CompactStats* stats = nullptr);
+
  private:
   std::string get_kprobe_event(const std::string& kernel_func,
                                bpf_probe_attach_type type);
   std::string get_uprobe_event(const std::string& binary_path, uint64_t offset,
                                bpf_probe_attach_type type, pid_t pid);
 
+  // Finds or creates the BPFPerfBuffer of table name for opening.
+  StatusTuple new_perf_buffer(const std::string& name, int page_cnt,
+                              BPFPerfBuffer** table);
+
+  // Loads func_name without recording it; safe to run concurrently.
+  StatusTuple load_func_fd(const std::string& func_name, bpf_prog_type type,
+                           int& fd, unsigned flags);
+
   StatusTuple attach_usdt_without_validation(const USDT& usdt, pid_t pid);
   StatusTuple detach_usdt_without_validation(const USDT& usdt, pid_t pid);
 
@@ -324,6 +427,7 @@ class BPF {
   std::map<std::string, open_probe_t> tracepoints_;
   std::map<std::string, open_probe_t> raw_tracepoints_;
   std::map<std::string, BPFPerfBuffer*> perf_buffers_;
+  std::unique_ptr<BPFRingBuffer> ring_buffer_;
   std::map<std::string, BPFPerfEventArray*> perf_event_arrays_;
   std::map<std::pair<uint32_t, uint32_t>, open_probe_t> perf_events_;
 };
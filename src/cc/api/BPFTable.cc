@@ -17,7 +17,10 @@
 #include <fcntl.h>
 #include <linux/elf.h>
 #include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <cerrno>
 #include <cinttypes>
@@ -292,6 +295,15 @@ std::vector<uintptr_t> BPFStackTable::get_stack_addr(int stack_id) {
   return res;
 }
 
+void* BPFStackTable::get_symcache(int pid) {
+  if (pid < 0)
+    pid = -1;
+  auto it = pid_sym_.find(pid);
+  if (it == pid_sym_.end())
+    it = pid_sym_.emplace(pid, bcc_symcache_new(pid, &symbol_option_)).first;
+  return it->second;
+}
+
 std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
                                                          int pid) {
   auto addresses = get_stack_addr(stack_id);
@@ -300,11 +312,7 @@ std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
     return res;
   res.reserve(addresses.size());
 
-  if (pid < 0)
-    pid = -1;
-  if (pid_sym_.find(pid) == pid_sym_.end())
-    pid_sym_[pid] = bcc_symcache_new(pid, &symbol_option_);
-  void* cache = pid_sym_[pid];
+  void* cache = get_symcache(pid);
 
   bcc_symbol symbol;
   for (auto addr : addresses)
@@ -318,6 +326,53 @@ std::vector<std::string> BPFStackTable::get_stack_symbol(int stack_id,
   return res;
 }
 
+BPFStackTable::StackSymbols BPFStackTable::get_stack_symbols(
+    const std::vector<std::pair<int, int>>& stacks) {
+  StackSymbols res;
+  res.frames.reserve(stacks.size());
+
+  std::unordered_map<int, std::vector<uintptr_t>> addresses;
+  std::unordered_map<int, std::unordered_map<uintptr_t, uint32_t>> pid_frames;
+  std::unordered_map<std::string, uint32_t> symbol_ids;
+
+  for (const auto& stack : stacks) {
+    int stack_id = stack.first;
+    int pid = stack.second < 0 ? -1 : stack.second;
+
+    auto addrs = addresses.find(stack_id);
+    if (addrs == addresses.end())
+      addrs = addresses.emplace(stack_id, get_stack_addr(stack_id)).first;
+
+    void* cache = get_symcache(pid);
+    auto& frame_ids = pid_frames[pid];
+    std::vector<uint32_t> frames;
+    frames.reserve(addrs->second.size());
+
+    for (auto addr : addrs->second) {
+      auto frame = frame_ids.find(addr);
+      if (frame == frame_ids.end()) {
+        bcc_symbol symbol;
+        std::string name;
+        if (bcc_symcache_resolve(cache, addr, &symbol) != 0)
+          name = "[UNKNOWN]";
+        else {
+          name = symbol.demangle_name;
+          bcc_symbol_free_demangle_name(&symbol);
+        }
+
+        auto id = symbol_ids.emplace(std::move(name), res.symbols.size());
+        if (id.second)
+          res.symbols.push_back(id.first->first);
+        frame = frame_ids.emplace(addr, id.first->second).first;
+      }
+      frames.push_back(frame->second);
+    }
+    res.frames.push_back(std::move(frames));
+  }
+
+  return res;
+}
+
 BPFStackBuildIdTable::BPFStackBuildIdTable(const TableDesc& desc, bool use_debug_file,
                                            bool check_debug_file_crc,
                                            void *bsymcache)
@@ -383,23 +438,41 @@ std::vector<std::string> BPFStackBuildIdTable::get_stack_symbol(int stack_id)
 }
 
 BPFPerfBuffer::BPFPerfBuffer(const TableDesc& desc)
-    : BPFTableBase<int, int>(desc), epfd_(-1) {
+    : BPFTableBase<int, int>(desc),
+      epfd_(-1),
+      flush_on_timeout_(false),
+      poll_threads_stop_(false),
+      poll_threads_wakefd_(-1) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
     throw std::invalid_argument("Table '" + desc.name +
                                 "' is not a perf buffer");
 }
 
 StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb,
+                                       perf_reader_batch_cb batch_cb,
                                        perf_reader_lost_cb lost_cb, int cpu,
-                                       void* cb_cookie, int page_cnt) {
+                                       void* cb_cookie, int page_cnt,
+                                       int wakeup_events,
+                                       int wakeup_watermark) {
   if (cpu_readers_.find(cpu) != cpu_readers_.end())
     return StatusTuple(-1, "Perf buffer already open on CPU %d", cpu);
 
+  struct bcc_perf_buffer_opts opts = {};
+  opts.pid = -1;
+  opts.cpu = cpu;
+  opts.wakeup_events = wakeup_events;
+  opts.wakeup_watermark = wakeup_watermark;
   auto reader = static_cast<perf_reader*>(
-      bpf_open_perf_buffer(cb, lost_cb, cb_cookie, -1, cpu, page_cnt));
+      bpf_open_perf_buffer_opts(cb, lost_cb, cb_cookie, page_cnt, &opts));
   if (reader == nullptr)
     return StatusTuple(-1, "Unable to construct perf reader");
 
+  if (batch_cb && perf_reader_set_batch_cb(reader, batch_cb) != 0) {
+    perf_reader_free(static_cast<void*>(reader));
+    return StatusTuple(-1, "Unable to set up batched perf reader on CPU %d",
+                       cpu);
+  }
+
   int reader_fd = perf_reader_fd(reader);
   if (!update(&cpu, &reader_fd)) {
     perf_reader_free(static_cast<void*>(reader));
@@ -422,16 +495,43 @@ StatusTuple BPFPerfBuffer::open_on_cpu(perf_reader_raw_cb cb,
 
 StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
                                         perf_reader_lost_cb lost_cb,
-                                        void* cb_cookie, int page_cnt) {
+                                        void* cb_cookie, int page_cnt,
+                                        int wakeup_events,
+                                        int wakeup_watermark) {
+  return open_all_cpu(cb, nullptr, lost_cb, cb_cookie, page_cnt, wakeup_events,
+                      wakeup_watermark);
+}
+
+StatusTuple BPFPerfBuffer::open_all_cpu_batch(perf_reader_batch_cb cb,
+                                              perf_reader_lost_cb lost_cb,
+                                              void* cb_cookie, int page_cnt,
+                                              int wakeup_events,
+                                              int wakeup_watermark) {
+  return open_all_cpu(nullptr, cb, lost_cb, cb_cookie, page_cnt, wakeup_events,
+                      wakeup_watermark);
+}
+
+StatusTuple BPFPerfBuffer::open_all_cpu(perf_reader_raw_cb cb,
+                                        perf_reader_batch_cb batch_cb,
+                                        perf_reader_lost_cb lost_cb,
+                                        void* cb_cookie, int page_cnt,
+                                        int wakeup_events,
+                                        int wakeup_watermark) {
   if (cpu_readers_.size() != 0 || epfd_ != -1)
     return StatusTuple(-1, "Previously opened perf buffer not cleaned");
+  if (wakeup_watermark < 0 ||
+      wakeup_watermark > page_cnt * getpagesize())
+    return StatusTuple(-1, "wakeup_watermark must fit in the perf buffer");
+  flush_on_timeout_ = wakeup_events > 1 || wakeup_watermark > 0;
+  last_flush_ = std::chrono::steady_clock::now();
 
   std::vector<int> cpus = get_online_cpus();
   ep_events_.reset(new epoll_event[cpus.size()]);
   epfd_ = epoll_create1(EPOLL_CLOEXEC);
 
   for (int i : cpus) {
-    auto res = open_on_cpu(cb, lost_cb, i, cb_cookie, page_cnt);
+    auto res = open_on_cpu(cb, batch_cb, lost_cb, i, cb_cookie, page_cnt,
+                           wakeup_events, wakeup_watermark);
     if (res.code() != 0) {
       TRY2(close_all_cpu());
       return res;
@@ -455,6 +555,12 @@ StatusTuple BPFPerfBuffer::close_all_cpu() {
   std::string errors;
   bool has_error = false;
 
+  auto stop_res = stop_poll_threads();
+  if (stop_res.code() != 0) {
+    has_error = true;
+    errors += stop_res.msg() + "\n";
+  }
+
   if (epfd_ >= 0) {
     int close_res = close(epfd_);
     epfd_ = -1;
@@ -489,9 +595,162 @@ int BPFPerfBuffer::poll(int timeout_ms) {
       epoll_wait(epfd_, ep_events_.get(), cpu_readers_.size(), timeout_ms);
   for (int i = 0; i < cnt; i++)
     perf_reader_event_read(static_cast<perf_reader*>(ep_events_[i].data.ptr));
+  if (flush_due(cnt, timeout_ms, &last_flush_)) {
+    std::vector<int> cpus;
+    for (auto it : cpu_readers_)
+      cpus.push_back(it.first);
+    flush(cpus);
+  }
   return cnt;
 }
 
+// With batched wakeups, samples below the wakeup threshold don't make the
+// perf fd readable. Drain them anyway so they are not held back forever.
+void BPFPerfBuffer::flush(const std::vector<int>& cpus) {
+  for (int cpu : cpus) {
+    auto it = cpu_readers_.find(cpu);
+    if (it != cpu_readers_.end())
+      perf_reader_event_read(it->second);
+  }
+}
+
+// A poll timing out flushes, and so does any poll timeout_ms after the last
+// flush, so that busy CPUs don't hold back the samples of quiet ones.
+bool BPFPerfBuffer::flush_due(int cnt, int timeout_ms,
+                              std::chrono::steady_clock::time_point* last_flush) {
+  if (!flush_on_timeout_)
+    return false;
+  auto now = std::chrono::steady_clock::now();
+  if (cnt != 0 &&
+      (timeout_ms < 0 ||
+       now - *last_flush < std::chrono::milliseconds(timeout_ms)))
+    return false;
+  *last_flush = now;
+  return true;
+}
+
+StatusTuple BPFPerfBuffer::start_poll_threads(int nthreads, int timeout_ms) {
+  if (epfd_ < 0)
+    return StatusTuple(-1, "Perf buffer %s not open", desc.name.c_str());
+  if (!poll_threads_.empty())
+    return StatusTuple(-1, "Poll threads already running");
+  if (nthreads <= 0)
+    return StatusTuple(-1, "Invalid number of poll threads %d", nthreads);
+
+  std::vector<int> cpus;
+  for (auto it : cpu_readers_)
+    cpus.push_back(it.first);
+  size_t n = std::min(cpus.size(), static_cast<size_t>(nthreads));
+  if (n == 0)
+    return StatusTuple(-1, "Perf buffer %s has no CPU buffers to poll",
+                       desc.name.c_str());
+
+  poll_threads_stop_ = false;
+  // Readable once stop_poll_threads() wants the threads to exit, so that
+  // they notice even while blocked without a timeout.
+  poll_threads_wakefd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (poll_threads_wakefd_ < 0)
+    return StatusTuple(-1, "Unable to create eventfd: %s",
+                       std::strerror(errno));
+  for (size_t i = 0; i < n; i++) {
+    std::unique_ptr<PollThread> t(new PollThread());
+    t->cpus.assign(cpus.begin() + i * cpus.size() / n,
+                   cpus.begin() + (i + 1) * cpus.size() / n);
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd < 0) {
+      int err = errno;
+      stop_poll_threads();
+      return StatusTuple(-1, "Unable to create epoll: %s", std::strerror(err));
+    }
+    struct epoll_event wake = {};
+    wake.events = EPOLLIN;
+    wake.data.ptr = nullptr;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, poll_threads_wakefd_, &wake)) {
+      int err = errno;
+      close(t->epfd);
+      stop_poll_threads();
+      return StatusTuple(-1, "Unable to add eventfd to epoll: %s",
+                         std::strerror(err));
+    }
+    for (int cpu : t->cpus) {
+      perf_reader* reader = cpu_readers_[cpu];
+      struct epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.ptr = static_cast<void*>(reader);
+      if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, perf_reader_fd(reader), &event)) {
+        int err = errno;
+        close(t->epfd);
+        stop_poll_threads();
+        return StatusTuple(-1, "Unable to add perf_reader FD to epoll: %s",
+                           std::strerror(err));
+      }
+    }
+
+    t->thread = std::thread(&BPFPerfBuffer::poll_thread_loop, this, t.get(),
+                            timeout_ms);
+    // Best effort: keep the thread on the CPUs whose buffers it drains so the
+    // ring pages stay in the local cache. Not fatal if the cpuset forbids it.
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int cpu : t->cpus)
+      CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(t->thread.native_handle(), sizeof(cpuset), &cpuset);
+
+    poll_threads_.push_back(std::move(t));
+  }
+  return StatusTuple::OK();
+}
+
+void BPFPerfBuffer::poll_thread_loop(PollThread* t, int timeout_ms) {
+  // One more event for the eventfd, which has no reader.
+  size_t max_events = t->cpus.size() + 1;
+  std::unique_ptr<epoll_event[]> events(new epoll_event[max_events]);
+  auto last_flush = std::chrono::steady_clock::now();
+
+  while (!poll_threads_stop_.load(std::memory_order_relaxed)) {
+    int cnt = epoll_wait(t->epfd, events.get(), max_events, timeout_ms);
+    for (int i = 0; i < cnt; i++) {
+      if (events[i].data.ptr)
+        perf_reader_event_read(static_cast<perf_reader*>(events[i].data.ptr));
+    }
+    if (flush_due(cnt, timeout_ms, &last_flush))
+      flush(t->cpus);
+  }
+}
+
+StatusTuple BPFPerfBuffer::stop_poll_threads() {
+  std::string errors;
+
+  poll_threads_stop_ = true;
+  if (poll_threads_wakefd_ >= 0) {
+    uint64_t one = 1;
+    if (write(poll_threads_wakefd_, &one, sizeof(one)) != sizeof(one))
+      errors += std::string(std::strerror(errno)) + "\n";
+  }
+  for (auto& t : poll_threads_) {
+    if (t->thread.joinable())
+      t->thread.join();
+    if (close(t->epfd) != 0)
+      errors += std::string(std::strerror(errno)) + "\n";
+  }
+  poll_threads_.clear();
+  if (poll_threads_wakefd_ >= 0) {
+    close(poll_threads_wakefd_);
+    poll_threads_wakefd_ = -1;
+  }
+
+  if (!errors.empty())
+    return StatusTuple(-1, "Failed to stop poll threads: %s", errors.c_str());
+  return StatusTuple::OK();
+}
+
+std::map<int, perf_reader_stats> BPFPerfBuffer::get_stats() {
+  std::map<int, perf_reader_stats> res;
+  for (auto it : cpu_readers_)
+    perf_reader_get_stats(it.second, &res[it.first]);
+  return res;
+}
+
 BPFPerfBuffer::~BPFPerfBuffer() {
   auto res = close_all_cpu();
   if (res.code() != 0)
@@ -499,6 +758,71 @@ BPFPerfBuffer::~BPFPerfBuffer() {
               << std::endl;
 }
 
+BPFRingBuffer::BPFRingBuffer(const TableDesc& desc)
+    : BPFTableBase<int, int>(desc), buffer_(nullptr) {
+  if (desc.type != BPF_MAP_TYPE_RINGBUF)
+    throw std::invalid_argument("Table '" + desc.name +
+                                "' is not a ring buffer");
+}
+
+StatusTuple BPFRingBuffer::open(ring_buffer_sample_fn cb, void* cb_cookie) {
+  if (buffer_ != nullptr)
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+
+  buffer_ = static_cast<struct ring_buffer*>(
+      bpf_new_ringbuf(desc.fd, cb, cb_cookie));
+  if (buffer_ == nullptr)
+    return StatusTuple(-1, "Unable to open ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(errno));
+  maps_.push_back(desc.name);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFRingBuffer::add(const TableDesc& desc, ring_buffer_sample_fn cb,
+                               void* cb_cookie) {
+  if (buffer_ == nullptr)
+    return StatusTuple(-1, "Ring buffer %s not open", this->desc.name.c_str());
+  if (desc.type != BPF_MAP_TYPE_RINGBUF)
+    return StatusTuple(-1, "Table '%s' is not a ring buffer",
+                       desc.name.c_str());
+  if (contains(desc.name))
+    return StatusTuple(-1, "Ring buffer %s already open", desc.name.c_str());
+
+  int res = bpf_add_ringbuf(buffer_, desc.fd, cb, cb_cookie);
+  if (res < 0)
+    return StatusTuple(-1, "Unable to add ring buffer %s: %s",
+                       desc.name.c_str(), std::strerror(-res));
+  maps_.push_back(desc.name);
+  return StatusTuple::OK();
+}
+
+StatusTuple BPFRingBuffer::close() {
+  if (buffer_ != nullptr) {
+    bpf_free_ringbuf(buffer_);
+    buffer_ = nullptr;
+  }
+  maps_.clear();
+  return StatusTuple::OK();
+}
+
+bool BPFRingBuffer::contains(const std::string& name) const {
+  return std::find(maps_.begin(), maps_.end(), name) != maps_.end();
+}
+
+int BPFRingBuffer::poll(int timeout_ms) {
+  if (buffer_ == nullptr)
+    return -1;
+  return bpf_poll_ringbuf(buffer_, timeout_ms);
+}
+
+int BPFRingBuffer::consume() {
+  if (buffer_ == nullptr)
+    return -1;
+  return bpf_consume_ringbuf(buffer_);
+}
+
+BPFRingBuffer::~BPFRingBuffer() { close(); }
+
 BPFPerfEventArray::BPFPerfEventArray(const TableDesc& desc)
     : BPFTableBase<int, int>(desc) {
   if (desc.type != BPF_MAP_TYPE_PERF_EVENT_ARRAY)
@@ -19,10 +19,15 @@
 #include <errno.h>
 #include <sys/epoll.h>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <exception>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -128,9 +133,79 @@ class BPFTableBase {
 
   bool remove(void* key) { return bpf_delete_elem(desc.fd, key) >= 0; }
 
+  bool batch_lookup(__u32* in_batch, __u32* out_batch, void* keys,
+                    void* values, __u32* count) {
+    return bpf_lookup_batch(desc.fd, in_batch, out_batch, keys, values,
+                            count) >= 0;
+  }
+
+  bool batch_lookup_and_delete(__u32* in_batch, __u32* out_batch, void* keys,
+                               void* values, __u32* count) {
+    return bpf_lookup_and_delete_batch(desc.fd, in_batch, out_batch, keys,
+                                       values, count) >= 0;
+  }
+
+  bool batch_update(void* keys, void* values, __u32* count) {
+    return bpf_update_batch(desc.fd, keys, values, count) >= 0;
+  }
+
+  bool batch_delete(void* keys, __u32* count) {
+    return bpf_delete_batch(desc.fd, keys, count) >= 0;
+  }
+
+  // Whether the last batch syscall failed because the kernel (pre 5.6) or
+  // the map type does not implement BPF_MAP_*_BATCH.
+  static bool batch_unsupported() {
+    return errno == EINVAL || errno == EOPNOTSUPP ||
+           errno == 524 /* ENOTSUPP */;
+  }
+
+  // Walk the whole map with BPF_MAP_LOOKUP_BATCH (or
+  // BPF_MAP_LOOKUP_AND_DELETE_BATCH), batch_size elements per syscall, and
+  // call cb(key, value) on the raw kernel buffers of every element.
+  // value_size is the per-element value stride, which for per-cpu maps
+  // covers all CPUs. Returns false with errno set on failure.
+  template <class Callback>
+  bool walk_batch(bool and_delete, size_t value_size, size_t batch_size,
+                  Callback cb) {
+    std::vector<char> keys, values;
+    __u32 in_batch = 0, out_batch = 0;
+    bool started = false;
+
+    if (batch_size == 0)
+      batch_size = 1;
+    while (true) {
+      keys.resize(batch_size * desc.key_size);
+      values.resize(batch_size * value_size);
+      __u32 count = batch_size;
+      __u32* in = started ? &in_batch : nullptr;
+      bool ok = and_delete ? batch_lookup_and_delete(in, &out_batch,
+                                                     keys.data(),
+                                                     values.data(), &count)
+                           : batch_lookup(in, &out_batch, keys.data(),
+                                          values.data(), &count);
+      if (!ok && errno == ENOSPC && count == 0) {
+        // A single hash bucket holds more elements than fit in the batch
+        batch_size *= 2;
+        continue;
+      }
+      if (!ok && errno != ENOENT)
+        return false;
+      for (__u32 i = 0; i < count; i++)
+        cb(&keys[i * desc.key_size], &values[i * value_size]);
+      if (!ok)
+        return true;
+      in_batch = out_batch;
+      started = true;
+    }
+  }
+
   const TableDesc& desc;
 };
 
+// Default number of elements transferred per BPF_MAP_*_BATCH syscall.
+static const size_t BPF_DEFAULT_BATCH_SIZE = 4096;
+
 class BPFTable : public BPFTableBase<void, void> {
  public:
   BPFTable(const TableDesc& desc);
@@ -162,6 +237,39 @@ void* get_value_addr(std::vector<ValueType>& t) {
   return t.data();
 }
 
+template <class ValueType>
+void set_value_from_buf(ValueType& t, const void* buf, size_t size) {
+  std::memcpy(&t, buf, std::min(size, sizeof(ValueType)));
+}
+
+template <class ValueType>
+void set_value_from_buf(std::vector<ValueType>& t, const void* buf,
+                        size_t size) {
+  t.resize(size / sizeof(ValueType));
+  std::memcpy(t.data(), buf, t.size() * sizeof(ValueType));
+}
+
+template <class ValueType>
+void copy_value_to_buf(const ValueType& t, void* buf, size_t size) {
+  std::memcpy(buf, &t, std::min(size, sizeof(ValueType)));
+}
+
+template <class ValueType>
+void copy_value_to_buf(const std::vector<ValueType>& t, void* buf,
+                       size_t size) {
+  std::memcpy(buf, t.data(), std::min(size, t.size() * sizeof(ValueType)));
+}
+
+// Size of one value in batch buffers: per-cpu maps return a value for each
+// possible CPU, each padded to 8 bytes.
+inline size_t batch_value_size(const TableDesc& desc, size_t ncpus) {
+  if (desc.type == BPF_MAP_TYPE_PERCPU_HASH ||
+      desc.type == BPF_MAP_TYPE_LRU_PERCPU_HASH ||
+      desc.type == BPF_MAP_TYPE_PERCPU_ARRAY)
+    return ((desc.leaf_size + 7) & ~7) * ncpus;
+  return desc.leaf_size;
+}
+
 template<class ValueType>
 class BPFQueueStackTable : public BPFQueueStackTableBase<void> {
  public:
@@ -229,6 +337,66 @@ class BPFArrayTable : public BPFTableBase<int, ValueType> {
 
     return res;
   }
+
+  // Read the whole array with BPF_MAP_LOOKUP_BATCH, batch_size elements per
+  // syscall. Falls back to per-index lookups on kernels without batch ops.
+  StatusTuple get_table_batch(std::vector<ValueType>& res,
+                              size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    size_t value_size = batch_value_size(
+        this->desc, BPFTable::get_possible_cpu_count());
+
+    res.clear();
+    res.resize(this->capacity());
+    bool ok = this->walk_batch(
+        false, value_size, batch_size, [&](const void* key, const void* value) {
+          int index = *static_cast<const int*>(key);
+          if (index >= 0 && (size_t)index < res.size())
+            set_value_from_buf(res[index], value, value_size);
+        });
+    if (ok)
+      return StatusTuple::OK();
+    if (!this->batch_unsupported())
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    for (int i = 0; i < (int)this->capacity(); i++)
+      TRY2(get_value(i, res[i]));
+    return StatusTuple::OK();
+  }
+
+  // Write values[i] to index i for every element of values, using
+  // BPF_MAP_UPDATE_BATCH where the kernel supports it.
+  virtual StatusTuple update_batch(const std::vector<ValueType>& values,
+                                   size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    size_t value_size = batch_value_size(
+        this->desc, BPFTable::get_possible_cpu_count());
+
+    if (values.size() > this->capacity())
+      return StatusTuple(-1, "too many values for array %s",
+                         this->desc.name.c_str());
+    if (batch_size == 0)
+      batch_size = 1;
+
+    std::vector<int> keys(std::min(batch_size, values.size()));
+    std::vector<char> buf(keys.size() * value_size);
+    for (size_t start = 0; start < values.size(); start += batch_size) {
+      __u32 count = std::min(batch_size, values.size() - start);
+      for (__u32 i = 0; i < count; i++) {
+        keys[i] = start + i;
+        copy_value_to_buf(values[start + i], &buf[i * value_size], value_size);
+      }
+      if (this->batch_update(keys.data(), buf.data(), &count))
+        continue;
+      if (start != 0 || !this->batch_unsupported())
+        return StatusTuple(-1, "Error updating batch: %s",
+                           std::strerror(errno));
+
+      for (size_t i = 0; i < values.size(); i++)
+        TRY2(update_value(i, values[i]));
+      break;
+    }
+    return StatusTuple::OK();
+  }
 };
 
 template <class ValueType>
@@ -258,6 +426,15 @@ class BPFPercpuArrayTable : public BPFArrayTable<std::vector<ValueType>> {
     return BPFArrayTable<std::vector<ValueType>>::update_value(index, value);
   }
 
+  StatusTuple update_batch(const std::vector<std::vector<ValueType>>& values,
+                           size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    for (const auto& value : values)
+      if (value.size() != ncpus)
+        return StatusTuple(-1, "bad value size");
+    return BPFArrayTable<std::vector<ValueType>>::update_batch(values,
+                                                               batch_size);
+  }
+
  private:
   unsigned int ncpus;
 };
@@ -345,6 +522,119 @@ class BPFHashTable : public BPFTableBase<KeyType, ValueType> {
 
     return StatusTuple::OK();
   }
+
+  // Read the whole table with BPF_MAP_LOOKUP_BATCH, batch_size elements per
+  // syscall. Falls back to get_next_key iteration on kernels without batch
+  // ops. Like get_table_offline(), the result is not an atomic snapshot.
+  StatusTuple get_table_batch(std::vector<std::pair<KeyType, ValueType>>& res,
+                              size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    res.clear();
+    if (dump_batch(false, batch_size, res))
+      return StatusTuple::OK();
+    if (!this->batch_unsupported())
+      return StatusTuple(-1, "Error looking up batch: %s",
+                         std::strerror(errno));
+
+    res = get_table_offline();
+    return StatusTuple::OK();
+  }
+
+  // Drain the table with BPF_MAP_LOOKUP_AND_DELETE_BATCH: every element
+  // returned in res has been removed from the map.
+  StatusTuple lookup_and_delete_batch(
+      std::vector<std::pair<KeyType, ValueType>>& res,
+      size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    res.clear();
+    if (dump_batch(true, batch_size, res))
+      return StatusTuple::OK();
+    if (!this->batch_unsupported())
+      return StatusTuple(-1, "Error looking up and deleting batch: %s",
+                         std::strerror(errno));
+
+    // Elements already in res are gone from the map, keep them and drain the
+    // rest one key at a time.
+    KeyType cur;
+    ValueType value;
+    while (this->first(&cur)) {
+      TRY2(get_value(cur, value));
+      TRY2(remove_value(cur));
+      res.emplace_back(cur, value);
+    }
+    return StatusTuple::OK();
+  }
+
+  virtual StatusTuple update_batch(
+      const std::vector<std::pair<KeyType, ValueType>>& entries,
+      size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    size_t value_size = batch_value_size(
+        this->desc, BPFTable::get_possible_cpu_count());
+    size_t key_size = this->desc.key_size;
+
+    if (batch_size == 0)
+      batch_size = 1;
+    size_t n = std::min(batch_size, entries.size());
+    std::vector<char> keys(n * key_size), values(n * value_size);
+    for (size_t start = 0; start < entries.size(); start += batch_size) {
+      __u32 count = std::min(batch_size, entries.size() - start);
+      for (__u32 i = 0; i < count; i++) {
+        const auto& entry = entries[start + i];
+        std::memcpy(&keys[i * key_size], &entry.first,
+                    std::min(key_size, sizeof(KeyType)));
+        copy_value_to_buf(entry.second, &values[i * value_size], value_size);
+      }
+      if (this->batch_update(keys.data(), values.data(), &count))
+        continue;
+      if (start != 0 || !this->batch_unsupported())
+        return StatusTuple(-1, "Error updating batch: %s",
+                           std::strerror(errno));
+
+      for (const auto& entry : entries)
+        TRY2(update_value(entry.first, entry.second));
+      break;
+    }
+    return StatusTuple::OK();
+  }
+
+  StatusTuple delete_batch(const std::vector<KeyType>& keys,
+                           size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    size_t key_size = this->desc.key_size;
+
+    if (batch_size == 0)
+      batch_size = 1;
+    std::vector<char> buf(std::min(batch_size, keys.size()) * key_size);
+    for (size_t start = 0; start < keys.size(); start += batch_size) {
+      __u32 count = std::min(batch_size, keys.size() - start);
+      for (__u32 i = 0; i < count; i++)
+        std::memcpy(&buf[i * key_size], &keys[start + i],
+                    std::min(key_size, sizeof(KeyType)));
+      if (this->batch_delete(buf.data(), &count))
+        continue;
+      if (start != 0 || !this->batch_unsupported())
+        return StatusTuple(-1, "Error deleting batch: %s",
+                           std::strerror(errno));
+
+      for (const auto& key : keys)
+        TRY2(remove_value(key));
+      break;
+    }
+    return StatusTuple::OK();
+  }
+
+ private:
+  bool dump_batch(bool and_delete, size_t batch_size,
+                  std::vector<std::pair<KeyType, ValueType>>& res) {
+    size_t value_size = batch_value_size(
+        this->desc, BPFTable::get_possible_cpu_count());
+
+    return this->walk_batch(
+        and_delete, value_size, batch_size,
+        [&](const void* key, const void* value) {
+          res.emplace_back();
+          std::memcpy(&res.back().first, key,
+                      std::min((size_t)this->desc.key_size, sizeof(KeyType)));
+          set_value_from_buf(res.back().second, value, value_size);
+        });
+  }
 };
 
 template <class KeyType, class ValueType>
@@ -377,6 +667,16 @@ class BPFPercpuHashTable
                                                                        value);
   }
 
+  StatusTuple update_batch(
+      const std::vector<std::pair<KeyType, std::vector<ValueType>>>& entries,
+      size_t batch_size = BPF_DEFAULT_BATCH_SIZE) {
+    for (const auto& entry : entries)
+      if (entry.second.size() != ncpus)
+        return StatusTuple(-1, "bad value size");
+    return BPFHashTable<KeyType, std::vector<ValueType>>::update_batch(
+        entries, batch_size);
+  }
+
  private:
   unsigned int ncpus;
 };
@@ -389,6 +689,13 @@ struct stacktrace_t {
 
 class BPFStackTable : public BPFTableBase<int, stacktrace_t> {
  public:
+  // Symbolized stacks in interned form: frames[i] holds the frames of the
+  // i-th requested stack as indices into symbols.
+  struct StackSymbols {
+    std::vector<std::string> symbols;
+    std::vector<std::vector<uint32_t>> frames;
+  };
+
   BPFStackTable(const TableDesc& desc, bool use_debug_file,
                 bool check_debug_file_crc);
   BPFStackTable(BPFStackTable&& that);
@@ -397,8 +704,14 @@ class BPFStackTable : public BPFTableBase<int, stacktrace_t> {
   void clear_table_non_atomic();
   std::vector<uintptr_t> get_stack_addr(int stack_id);
   std::vector<std::string> get_stack_symbol(int stack_id, int pid);
+  // Symbolize many (stack_id, pid) pairs at once. Each stack is read once and
+  // each distinct address of a pid is resolved once, however often it occurs.
+  StackSymbols get_stack_symbols(
+      const std::vector<std::pair<int, int>>& stacks);
 
  private:
+  void* get_symcache(int pid);
+
   bcc_symbol_option symbol_option_;
   std::map<int, void*> pid_sym_;
 };
@@ -428,20 +741,88 @@ class BPFPerfBuffer : public BPFTableBase<int, int> {
   BPFPerfBuffer(const TableDesc& desc);
   ~BPFPerfBuffer();
 
+  // wakeup_events and wakeup_watermark select when the kernel wakes up the
+  // poller, see struct bcc_perf_buffer_opts. Anything but a wakeup on every
+  // sample makes poll() flush all CPUs when it times out, or when timeout_ms
+  // passed since the last flush, so timeout_ms bounds the delivery latency.
   StatusTuple open_all_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                           void* cb_cookie, int page_cnt);
+                           void* cb_cookie, int page_cnt,
+                           int wakeup_events = 1, int wakeup_watermark = 0);
+  // Batched variant: each poll hands every CPU's pending samples to cb in
+  // one call, without copying them out of the perf ring.
+  StatusTuple open_all_cpu_batch(perf_reader_batch_cb cb,
+                                 perf_reader_lost_cb lost_cb, void* cb_cookie,
+                                 int page_cnt, int wakeup_events = 1,
+                                 int wakeup_watermark = 0);
   StatusTuple close_all_cpu();
   int poll(int timeout_ms);
 
+  // Drain the per-CPU buffers from nthreads background threads instead of
+  // poll(). The opened CPUs are split into contiguous ranges, one per thread,
+  // and each thread is pinned to the CPUs it drains. Callbacks are invoked
+  // on those threads, concurrently for different CPUs. A negative timeout_ms
+  // waits for samples indefinitely; stopping wakes the threads up anyway.
+  StatusTuple start_poll_threads(int nthreads, int timeout_ms = 100);
+  StatusTuple stop_poll_threads();
+  // Throughput and loss counters of every opened CPU buffer.
+  std::map<int, perf_reader_stats> get_stats();
+
  private:
-  StatusTuple open_on_cpu(perf_reader_raw_cb cb, perf_reader_lost_cb lost_cb,
-                          int cpu, void* cb_cookie, int page_cnt);
+  struct PollThread {
+    int epfd;
+    std::vector<int> cpus;
+    std::thread thread;
+  };
+
+  void poll_thread_loop(PollThread* t, int timeout_ms);
+  void flush(const std::vector<int>& cpus);
+  bool flush_due(int cnt, int timeout_ms,
+                 std::chrono::steady_clock::time_point* last_flush);
+
+  StatusTuple open_all_cpu(perf_reader_raw_cb cb, perf_reader_batch_cb batch_cb,
+                           perf_reader_lost_cb lost_cb, void* cb_cookie,
+                           int page_cnt, int wakeup_events,
+                           int wakeup_watermark);
+  StatusTuple open_on_cpu(perf_reader_raw_cb cb, perf_reader_batch_cb batch_cb,
+                          perf_reader_lost_cb lost_cb, int cpu,
+                          void* cb_cookie, int page_cnt, int wakeup_events,
+                          int wakeup_watermark);
   StatusTuple close_on_cpu(int cpu);
 
   std::map<int, perf_reader*> cpu_readers_;
 
   int epfd_;
   std::unique_ptr<epoll_event[]> ep_events_;
+  // Set when wakeups are batched and poll() must flush on timeout.
+  bool flush_on_timeout_;
+  std::chrono::steady_clock::time_point last_flush_;
+
+  std::vector<std::unique_ptr<PollThread>> poll_threads_;
+  std::atomic<bool> poll_threads_stop_;
+  // eventfd in every poll thread's epoll set to wake it up for stopping.
+  int poll_threads_wakefd_;
+};
+
+class BPFRingBuffer : public BPFTableBase<int, int> {
+ public:
+  BPFRingBuffer(const TableDesc& desc);
+  ~BPFRingBuffer();
+
+  // Start consuming this ring buffer map, calling cb for every record.
+  StatusTuple open(ring_buffer_sample_fn cb, void* cb_cookie);
+  // Consume another ring buffer map through the same epoll instance, so a
+  // single poll() serves all of them.
+  StatusTuple add(const TableDesc& desc, ring_buffer_sample_fn cb,
+                  void* cb_cookie);
+  StatusTuple close();
+  bool contains(const std::string& name) const;
+  // Returns number of records consumed, or a negative value on error.
+  int poll(int timeout_ms);
+  int consume();
+
+ private:
+  struct ring_buffer* buffer_;
+  std::vector<std::string> maps_;
 };
 
 class BPFPerfEventArray : public BPFTableBase<int, int> {
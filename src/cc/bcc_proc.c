@@ -15,6 +15,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -206,58 +207,103 @@ done:
   return 0;
 }
 
-int bcc_procutils_each_ksym(bcc_procutils_ksymcb callback, void *payload) {
-  char line[2048];
-  char *symname, *endsym, *modname, *endmod = NULL;
-  FILE *kallsyms;
+static void parse_ksym_line(char *line, bcc_procutils_ksymcb callback,
+                            void *payload) {
+  char *symname, *endsym, *modname, *endmod;
   unsigned long long addr;
 
+  addr = strtoull(line, &symname, 16);
+  if (addr == 0 || addr == ULLONG_MAX)
+    return;
+  if (addr < kernelAddrSpace)
+    return;
+
+  symname++;
+  // Ignore data symbols
+  if (*symname == 'b' || *symname == 'B' || *symname == 'd' ||
+      *symname == 'D' || *symname == 'r' || *symname =='R')
+    return;
+
+  endsym = (symname = symname + 2);
+  while (*endsym && !isspace(*endsym)) endsym++;
+
+  // Parse module name if it's available
+  modname = "kernel";
+  if (*endsym) {
+    *endsym = '\0';
+    endmod = endsym + 1;
+    while (*endmod && isspace(*endmod)) endmod++;
+    if (*endmod == '[') {
+      char *start = ++endmod;
+      while (*endmod && *endmod != ']') endmod++;
+      if (*endmod) {
+        *endmod = '\0';
+        modname = start;
+      }
+    }
+  }
+
+  callback(symname, modname, addr, payload);
+}
+
+#define KSYM_BUF_SIZE (256 * 1024)
+
+int bcc_procutils_each_ksym(bcc_procutils_ksymcb callback, void *payload) {
+  char *buf, *line, *nl;
+  size_t len = 0;
+  ssize_t n;
+  int fd, skip = 0;
+
   /* root is needed to list ksym addresses */
   if (geteuid() != 0)
     return -1;
 
-  kallsyms = fopen("/proc/kallsyms", "r");
-  if (!kallsyms)
+  fd = open("/proc/kallsyms", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     return -1;
 
-  while (fgets(line, sizeof(line), kallsyms)) {
-    addr = strtoull(line, &symname, 16);
-    if (addr == 0 || addr == ULLONG_MAX)
-      continue;
-    if (addr < kernelAddrSpace)
-      continue;
+  buf = malloc(KSYM_BUF_SIZE);
+  if (!buf) {
+    close(fd);
+    return -1;
+  }
 
-    symname++;
-    // Ignore data symbols
-    if (*symname == 'b' || *symname == 'B' || *symname == 'd' ||
-        *symname == 'D' || *symname == 'r' || *symname =='R')
+  // kallsyms is large and has no size, read it in big chunks and parse the
+  // complete lines of each in place.
+  for (;;) {
+    n = read(fd, buf + len, KSYM_BUF_SIZE - 1 - len);
+    if (n < 0 && errno == EINTR)
       continue;
-
-    endsym = (symname = symname + 2);
-    while (*endsym && !isspace(*endsym)) endsym++;
-    *endsym = '\0';
-
-    // Parse module name if it's available
-    modname = endsym + 1;
-    while (*modname && isspace(*endsym)) modname++;
-
-    if (*modname && *modname == '[') {
-      endmod = ++modname;
-      while (*endmod && *endmod != ']') endmod++;
-      if (*endmod)
-        *(endmod) = '\0';
-      else
-        endmod = NULL;
+    if (n <= 0)
+      break;
+    len += n;
+    buf[len] = '\0';
+
+    line = buf;
+    while ((nl = memchr(line, '\n', buf + len - line))) {
+      *nl = '\0';
+      if (!skip)
+        parse_ksym_line(line, callback, payload);
+      skip = 0;
+      line = nl + 1;
     }
-
-    if (!endmod)
-      modname = "kernel";
-
-    callback(symname, modname, addr, payload);
+    len = buf + len - line;
+    if (len == KSYM_BUF_SIZE - 1) {
+      // drop a line that cannot fit, up to its end
+      len = 0;
+      skip = 1;
+    } else {
+      memmove(buf, line, len);
+    }
+  }
+  if (n == 0 && len > 0 && !skip) {
+    buf[len] = '\0';
+    parse_ksym_line(buf, callback, payload);
   }
 
-  fclose(kallsyms);
-  return 0;
+  free(buf);
+  close(fd);
+  return n < 0 ? -1 : 0;
 }
 
 #define CACHE1_HEADER "ld.so-1.7.0"
@@ -14,16 +14,20 @@
  * limitations under the License.
  */
 
+#include <cerrno>
 #include <cxxabi.h>
 #include <cstring>
 #include <fcntl.h>
 #include <linux/elf.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <cstdio>
+#include <ctime>
+#include <set>
 
 #include "bcc_elf.h"
 #include "bcc_perf_map.h"
@@ -47,63 +51,577 @@ bool ProcStat::is_stale() {
 ProcStat::ProcStat(int pid)
     : procfs_(tfm::format("/proc/%d/exe", pid)), inode_(getinode_()) {}
 
+namespace {
+
+bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = static_cast<const char *>(buf);
+  while (len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool read_all(int fd, void *buf, size_t len) {
+  char *p = static_cast<char *>(buf);
+  while (len > 0) {
+    ssize_t n = ::read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// On-disk layout of a kallsyms snapshot: header, then the KSyms arrays
+// addrs_, name_offs_ and mod_offs_, then the names.
+struct KSymsSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t modules_id;
+  uint64_t nsyms;
+  uint64_t names_size;
+};
+
+const char kKSymsSnapshotMagic[8] = {'B', 'C', 'C', 'K', 'S', 'Y', 'M', '\0'};
+const uint32_t kKSymsSnapshotVersion = 1;
+
+std::string boot_id() {
+  char buf[64] = {};
+  ebpf::FileDesc fd(::open("/proc/sys/kernel/random/boot_id",
+                           O_RDONLY | O_CLOEXEC));
+  if (fd < 0 || ::read(fd, buf, sizeof(buf) - 1) <= 0)
+    return std::string();
+  std::string id(buf);
+  while (!id.empty() && isspace(id.back()))
+    id.pop_back();
+  return id;
+}
+
+// Loaded kernel modules by name, with their load addresses. These are what
+// changes kallsyms short of a reboot.
+std::map<std::string, uint64_t> kernel_modules() {
+  std::map<std::string, uint64_t> mods;
+  FILE *f = fopen("/proc/modules", "re");
+  if (!f)
+    return mods;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    // "name size refcnt deps state addr"
+    char name[256];
+    unsigned long long addr;
+    if (sscanf(line, "%255s %*s %*s %*s %*s %llx", name, &addr) == 2)
+      mods[name] = addr;
+  }
+  fclose(f);
+  return mods;
+}
+
+uint64_t kernel_modules_id(const std::map<std::string, uint64_t> &mods) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (auto &mod : mods) {
+    for (char c : mod.first)
+      hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+    for (int i = 0; i < 64; i += 8)
+      hash = (hash ^ (uint8_t)(mod.second >> i)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const uint64_t kModulesCheckInterval = 1000000000ULL;
+
+}  // namespace
+
+struct KSyms::Loader {
+  struct Entry {
+    uint64_t addr;
+    uint32_t name_off;
+    uint32_t mod_off;
+  };
+  Loader(KSyms *ks, const std::set<std::string> *only)
+      : ks(ks), only(only), last_mod(UINT32_MAX) {}
+  KSyms *ks;
+  // Modules to read the symbols of, or all if null.
+  const std::set<std::string> *only;
+  std::vector<Entry> syms;
+  // Symbols of a module come in a row, so remember the last one.
+  uint32_t last_mod;
+};
+
+KSyms::KSyms(ModulesSource modules, SymbolsSource symbols)
+    : modules_src_(std::move(modules)),
+      symbols_src_(std::move(symbols)),
+      from_kernel_(!modules_src_ && !symbols_src_) {
+  if (!modules_src_)
+    modules_src_ = kernel_modules;
+  if (!symbols_src_)
+    symbols_src_ = [](bcc_procutils_ksymcb cb, void *payload) {
+      bcc_procutils_each_ksym(cb, payload);
+    };
+}
+
 void KSyms::_add_symbol(const char *symname, const char *modname, uint64_t addr, void *p) {
-  KSyms *ks = static_cast<KSyms *>(p);
-  ks->syms_.emplace_back(symname, modname, addr);
+  Loader *l = static_cast<Loader *>(p);
+  std::string &names = l->ks->names_;
+  if (l->last_mod == UINT32_MAX || strcmp(names.c_str() + l->last_mod, modname)) {
+    if (l->only && !l->only->count(modname))
+      return;
+    auto res = l->ks->mod_names_.emplace(modname, names.size());
+    if (res.second)
+      names.append(modname, strlen(modname) + 1);
+    l->last_mod = res.first->second;
+  }
+  uint32_t name_off = names.size();
+  names.append(symname, strlen(symname) + 1);
+  l->syms.push_back({addr, name_off, l->last_mod});
 }
 
-void KSyms::refresh() {
-  if (syms_.empty()) {
-    bcc_procutils_each_ksym(_add_symbol, this);
-    std::sort(syms_.begin(), syms_.end());
+bool KSyms::load_snapshot(const std::string &file, uint64_t modules_id) {
+  struct stat st;
+  ebpf::FileDesc fd(ebpf::open_private_file(file, &st));
+  KSymsSnapshotHeader hdr;
+  if (fd < 0 || !read_all(fd, &hdr, sizeof(hdr)))
+    return false;
+
+  const uint64_t kEntrySize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+  uint64_t n = hdr.nsyms;
+  if (memcmp(hdr.magic, kKSymsSnapshotMagic, sizeof(hdr.magic)) ||
+      hdr.version != kKSymsSnapshotVersion || hdr.modules_id != modules_id ||
+      n > (uint64_t)st.st_size / kEntrySize || hdr.names_size > UINT32_MAX ||
+      (uint64_t)st.st_size != sizeof(hdr) + n * kEntrySize + hdr.names_size ||
+      hdr.names_size == 0)
+    return false;
+
+  addrs_.resize(n);
+  name_offs_.resize(n);
+  mod_offs_.resize(n);
+  names_.resize(hdr.names_size);
+  bool ok = read_all(fd, addrs_.data(), n * sizeof(uint64_t)) &&
+            read_all(fd, name_offs_.data(), n * sizeof(uint32_t)) &&
+            read_all(fd, mod_offs_.data(), n * sizeof(uint32_t)) &&
+            read_all(fd, &names_[0], names_.size()) && names_.back() == '\0';
+  for (uint64_t i = 0; ok && i < n; i++)
+    ok = name_offs_[i] < names_.size() && mod_offs_[i] < names_.size() &&
+         (i == 0 || addrs_[i - 1] <= addrs_[i]);
+  if (!ok) {
+    addrs_.clear();
+    name_offs_.clear();
+    mod_offs_.clear();
+    names_.clear();
+    return false;
   }
+
+  uint32_t last = UINT32_MAX;
+  for (uint32_t off : mod_offs_)
+    if (off != last)
+      mod_names_.emplace(names_.c_str() + (last = off), off);
+  return true;
 }
 
-bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
-  refresh();
+void KSyms::save_snapshot(const std::string &file, uint64_t modules_id) const {
+  KSymsSnapshotHeader hdr = {};
+  memcpy(hdr.magic, kKSymsSnapshotMagic, sizeof(hdr.magic));
+  hdr.version = kKSymsSnapshotVersion;
+  hdr.modules_id = modules_id;
+  hdr.nsyms = addrs_.size();
+  hdr.names_size = names_.size();
+
+  // Kernel addresses are not for everyone to see either.
+  ebpf::write_private_file(file, [&](int fd, const std::string &) {
+    return write_all(fd, &hdr, sizeof(hdr)) &&
+           write_all(fd, addrs_.data(), addrs_.size() * sizeof(uint64_t)) &&
+           write_all(fd, name_offs_.data(),
+                     name_offs_.size() * sizeof(uint32_t)) &&
+           write_all(fd, mod_offs_.data(),
+                     mod_offs_.size() * sizeof(uint32_t)) &&
+           write_all(fd, names_.data(), names_.size());
+  });
+}
 
-  std::vector<Symbol>::iterator it;
+void KSyms::load() {
+  retire_names(true);
+  // Modules are listed before reading kallsyms: one loaded in between is
+  // then seen as new on the next check, and its symbols replaced.
+  modules_ = modules_src_();
+  next_modules_check_ = monotonic_ns() + kModulesCheckInterval;
+
+  // With BCC_SYM_INDEX_DIR set, kallsyms is also kept there as a snapshot,
+  // valid until the next reboot or change of the loaded modules. Symbols of
+  // code generated later, like BPF programs, may be missing from it.
+  std::string snapshot;
+  uint64_t modules_id = kernel_modules_id(modules_);
+  const char *dir = getenv("BCC_SYM_INDEX_DIR");
+  if (from_kernel_ && dir && *dir && geteuid() == 0) {
+    std::string id = boot_id();
+    if (!id.empty()) {
+      snapshot = tfm::format("%s/kallsyms-%s.ksymidx", dir, id);
+      if (load_snapshot(snapshot, modules_id))
+        return;
+    }
+  }
 
-  if (syms_.empty())
-    goto unknown_symbol;
+  Loader l(this, nullptr);
+  symbols_src_(_add_symbol, &l);
+  std::sort(l.syms.begin(), l.syms.end(),
+            [](const Loader::Entry &a, const Loader::Entry &b) {
+              return a.addr < b.addr;
+            });
+
+  addrs_.reserve(l.syms.size());
+  name_offs_.reserve(l.syms.size());
+  mod_offs_.reserve(l.syms.size());
+  for (auto &e : l.syms) {
+    addrs_.push_back(e.addr);
+    name_offs_.push_back(e.name_off);
+    mod_offs_.push_back(e.mod_off);
+  }
+  names_.shrink_to_fit();
 
-  it = std::upper_bound(syms_.begin(), syms_.end(), Symbol("", "", addr));
-  if (it != syms_.begin()) {
-    it--;
-    sym->name = (*it).name.c_str();
-    if (demangle)
-      sym->demangle_name = sym->name;
-    sym->module = (*it).mod.c_str();
-    sym->offset = addr - (*it).addr;
-    return true;
+  if (!snapshot.empty() && !addrs_.empty())
+    save_snapshot(snapshot, modules_id);
+}
+
+void KSyms::remove_module(const std::string &name) {
+  auto it = mod_names_.find(name);
+  if (it == mod_names_.end())
+    return;
+  uint32_t mod_off = it->second;
+
+  size_t n = 0;
+  for (size_t i = 0; i < addrs_.size(); i++) {
+    if (mod_offs_[i] == mod_off) {
+      dead_names_ += strlen(names_.c_str() + name_offs_[i]) + 1;
+      continue;
+    }
+    addrs_[n] = addrs_[i];
+    name_offs_[n] = name_offs_[i];
+    mod_offs_[n] = mod_offs_[i];
+    n++;
   }
+  addrs_.resize(n);
+  name_offs_.resize(n);
+  mod_offs_.resize(n);
+}
 
-unknown_symbol:
-  memset(sym, 0, sizeof(struct bcc_symbol));
-  return false;
+// Moves the name arena aside before it is changed, if resolve_addr() handed
+// out pointers into it, so they stay valid until the next refresh().
+void KSyms::retire_names(bool keep_contents) {
+  if (!names_in_use_)
+    return;
+  retired_names_.push_back(std::move(names_));
+  if (keep_contents)
+    names_ = retired_names_.back();
+  names_in_use_ = false;
 }
 
-bool KSyms::resolve_name(const char *_unused, const char *name,
-                         uint64_t *addr) {
-  refresh();
+// Copies the names still in use to a new arena once unloaded modules left
+// half of the old one unused.
+void KSyms::compact_names() {
+  std::string names;
+  names.reserve(names_.size() - dead_names_);
+  std::unordered_map<std::string, uint32_t> mod_names;
+  for (size_t i = 0; i < addrs_.size(); i++) {
+    const char *mod = names_.c_str() + mod_offs_[i];
+    auto res = mod_names.emplace(mod, names.size());
+    if (res.second)
+      names.append(mod, strlen(mod) + 1);
+    mod_offs_[i] = res.first->second;
+
+    const char *name = names_.c_str() + name_offs_[i];
+    name_offs_[i] = names.size();
+    names.append(name, strlen(name) + 1);
+  }
+  retire_names(false);
+  names_ = std::move(names);
+  mod_names_ = std::move(mod_names);
+  dead_names_ = 0;
+}
 
-  if (syms_.size() != symnames_.size()) {
-    symnames_.clear();
-    for (Symbol &sym : syms_) {
-      symnames_[sym.name] = sym.addr;
+void KSyms::update_modules() {
+  next_modules_check_ = monotonic_ns() + kModulesCheckInterval;
+  std::map<std::string, uint64_t> mods = modules_src_();
+  if (mods == modules_)
+    return;
+
+  // Modules that went away or moved lose their symbols, and modules that are
+  // new or moved have them read again.
+  std::set<std::string> added;
+  for (auto &mod : modules_) {
+    auto it = mods.find(mod.first);
+    if (it == mods.end() || it->second != mod.second)
+      remove_module(mod.first);
+  }
+  for (auto &mod : mods) {
+    auto it = modules_.find(mod.first);
+    if (it == modules_.end() || it->second != mod.second) {
+      remove_module(mod.first);
+      added.insert(mod.first);
     }
   }
+  modules_ = std::move(mods);
+  by_name_.clear();
+
+  if (!added.empty()) {
+    retire_names(true);
+    Loader l(this, &added);
+    symbols_src_(_add_symbol, &l);
+    std::sort(l.syms.begin(), l.syms.end(),
+              [](const Loader::Entry &a, const Loader::Entry &b) {
+                return a.addr < b.addr;
+              });
+
+    // Merge the new symbols into the sorted arrays from the back, in place.
+    size_t i = addrs_.size(), j = l.syms.size(), k = i + j;
+    addrs_.resize(k);
+    name_offs_.resize(k);
+    mod_offs_.resize(k);
+    while (j > 0) {
+      k--;
+      if (i > 0 && addrs_[i - 1] > l.syms[j - 1].addr) {
+        i--;
+        addrs_[k] = addrs_[i];
+        name_offs_[k] = name_offs_[i];
+        mod_offs_[k] = mod_offs_[i];
+      } else {
+        j--;
+        addrs_[k] = l.syms[j].addr;
+        name_offs_[k] = l.syms[j].name_off;
+        mod_offs_[k] = l.syms[j].mod_off;
+      }
+    }
+  }
+
+  if (dead_names_ > names_.size() / 2)
+    compact_names();
+}
+
+void KSyms::refresh() {
+  retired_names_.clear();
+  names_in_use_ = false;
+  if (addrs_.empty())
+    load();
+  else
+    update_modules();
+}
+
+bool KSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle) {
+  if (addrs_.empty())
+    load();
+  else if (monotonic_ns() >= next_modules_check_)
+    update_modules();
+
+  auto it = std::upper_bound(addrs_.begin(), addrs_.end(), addr);
+  if (it == addrs_.begin()) {
+    memset(sym, 0, sizeof(struct bcc_symbol));
+    return false;
+  }
+
+  size_t i = it - addrs_.begin() - 1;
+  sym->name = names_.c_str() + name_offs_[i];
+  if (demangle)
+    sym->demangle_name = sym->name;
+  sym->module = names_.c_str() + mod_offs_[i];
+  sym->offset = addr - addrs_[i];
+  names_in_use_ = true;
+  return true;
+}
+
+bool KSyms::resolve_name(const char *_unused, const char *name,
+                         uint64_t *addr) {
+  if (addrs_.empty())
+    load();
+  else if (monotonic_ns() >= next_modules_check_)
+    update_modules();
+
+  if (by_name_.size() != addrs_.size()) {
+    by_name_.resize(addrs_.size());
+    for (size_t i = 0; i < by_name_.size(); i++)
+      by_name_[i] = i;
+    std::stable_sort(by_name_.begin(), by_name_.end(),
+                     [this](uint32_t a, uint32_t b) {
+                       return strcmp(names_.c_str() + name_offs_[a],
+                                     names_.c_str() + name_offs_[b]) < 0;
+                     });
+  }
 
-  auto it = symnames_.find(name);
-  if (it == symnames_.end())
+  // Duplicate names resolve to the highest address.
+  auto it = std::upper_bound(by_name_.begin(), by_name_.end(), name,
+                             [this](const char *n, uint32_t i) {
+                               return strcmp(n, names_.c_str() + name_offs_[i]) < 0;
+                             });
+  if (it == by_name_.begin())
+    return false;
+  --it;
+  if (strcmp(name, names_.c_str() + name_offs_[*it]))
     return false;
 
-  *addr = it->second;
+  *addr = addrs_[*it];
   return true;
 }
 
+namespace {
+
+// On-disk layout: header, nsyms entries sorted by start, then a table of
+// NUL-terminated names referenced by Entry::name_off.
+struct SymbolIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t nsyms;
+  uint64_t strtab_size;
+};
+
+const char kSymbolIndexMagic[8] = {'B', 'C', 'C', 'S', 'Y', 'M', 'I', '\0'};
+const uint32_t kSymbolIndexVersion = 1;
+
+}  // namespace
+
+SymbolIndex::SymbolIndex(void *base, size_t len) : base_(base), len_(len) {
+  auto hdr = static_cast<const SymbolIndexHeader *>(base_);
+  syms_ = reinterpret_cast<const Entry *>(hdr + 1);
+  nsyms_ = hdr->nsyms;
+  strtab_ = reinterpret_cast<const char *>(syms_ + nsyms_);
+  strtab_size_ = hdr->strtab_size;
+}
+
+SymbolIndex::~SymbolIndex() { munmap(base_, len_); }
+
+std::shared_ptr<SymbolIndex> SymbolIndex::open(const std::string &file) {
+  struct stat st;
+  ebpf::FileDesc fd(ebpf::open_private_file(file, &st));
+  if (fd < 0 || (size_t)st.st_size < sizeof(SymbolIndexHeader))
+    return nullptr;
+
+  size_t len = st.st_size;
+  void *base = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    return nullptr;
+
+  // Reject anything that is not exactly what build() would have written, so
+  // a truncated or foreign file can never make us read out of bounds.
+  auto hdr = static_cast<const SymbolIndexHeader *>(base);
+  const char *strtab_end = static_cast<const char *>(base) + len;
+  if (memcmp(hdr->magic, kSymbolIndexMagic, sizeof(kSymbolIndexMagic)) ||
+      hdr->version != kSymbolIndexVersion ||
+      hdr->entry_size != sizeof(Entry) ||
+      hdr->nsyms > (len - sizeof(*hdr)) / sizeof(Entry) ||
+      len != sizeof(*hdr) + hdr->nsyms * sizeof(Entry) + hdr->strtab_size ||
+      (hdr->strtab_size > 0 && strtab_end[-1] != '\0')) {
+    munmap(base, len);
+    return nullptr;
+  }
+
+  return std::shared_ptr<SymbolIndex>(new SymbolIndex(base, len));
+}
+
+bool SymbolIndex::build(const std::string &path,
+                        const bcc_symbol_option *option,
+                        const std::string &file) {
+  struct Builder {
+    std::vector<Entry> syms;
+    std::string strtab;
+    std::unordered_map<std::string, uint64_t> offsets;
+  } b;
+
+  auto cb = [](const char *symname, uint64_t start, uint64_t size, void *p) {
+    Builder *b = static_cast<Builder *>(p);
+    auto res = b->offsets.emplace(symname, b->strtab.size());
+    if (res.second)
+      b->strtab.append(symname, strlen(symname) + 1);
+    b->syms.push_back({start, size, res.first->second});
+    return 0;
+  };
+  bcc_symbol_option opt = *option;
+  opt.lazy_symbolize = 0;
+  if (bcc_elf_foreach_sym(path.c_str(), cb, &opt, &b) < 0)
+    return false;
+
+  std::sort(b.syms.begin(), b.syms.end(),
+            [](const Entry &a, const Entry &b) { return a.start < b.start; });
+
+  SymbolIndexHeader hdr;
+  memcpy(hdr.magic, kSymbolIndexMagic, sizeof(hdr.magic));
+  hdr.version = kSymbolIndexVersion;
+  hdr.entry_size = sizeof(Entry);
+  hdr.nsyms = b.syms.size();
+  hdr.strtab_size = b.strtab.size();
+
+  return ebpf::write_private_file(file, [&](int fd, const std::string &) {
+    return write_all(fd, &hdr, sizeof(hdr)) &&
+           write_all(fd, b.syms.data(), b.syms.size() * sizeof(Entry)) &&
+           write_all(fd, b.strtab.data(), b.strtab.size());
+  });
+}
+
+std::shared_ptr<SymbolIndex> SymbolIndex::load(
+    const std::string &path, const bcc_symbol_option *option) {
+  const char *dir = getenv("BCC_SYM_INDEX_DIR");
+  if (!dir || !*dir)
+    return nullptr;
+
+  std::string key;
+  char buildid[BPF_BUILD_ID_SIZE * 2 + 1] = {};
+  if (bcc_elf_get_buildid(path.c_str(), buildid) == 0 && buildid[0]) {
+    key = buildid;
+  } else {
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+      return nullptr;
+    key = tfm::format("%lx-%lx-%lx.%lx-%lx", (uint64_t)st.st_dev,
+                      (uint64_t)st.st_ino, (uint64_t)st.st_mtim.tv_sec,
+                      (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_size);
+  }
+  // The symbol options decide which symbols end up in the table; build()
+  // ignores lazy_symbolize.
+  std::string file = tfm::format("%s/%s-%x-%d%d.symidx", dir, key,
+                                 option->use_symbol_type,
+                                 option->use_debug_file ? 1 : 0,
+                                 option->check_debug_file_crc ? 1 : 0);
+
+  auto index = open(file);
+  if (!index && build(path, option, file))
+    index = open(file);
+  return index;
+}
+
+const SymbolIndex::Entry *SymbolIndex::floor(uint64_t offset) const {
+  auto it = std::upper_bound(
+      syms_, syms_ + nsyms_, offset,
+      [](uint64_t off, const Entry &e) { return off < e.start; });
+  return it == syms_ ? nullptr : it - 1;
+}
+
+const SymbolIndex::Entry *SymbolIndex::find(uint64_t offset) const {
+  // Same nested-symbol walk as ProcSyms::Module::find_addr().
+  const Entry *it = floor(offset);
+  if (!it)
+    return nullptr;
+  uint64_t limit = it->start;
+  for (;; --it) {
+    if (offset < it->start + it->size)
+      return it;
+    if (limit > it->start + it->size || it == syms_)
+      return nullptr;
+  }
+}
+
 ProcSyms::ProcSyms(int pid, struct bcc_symbol_option *option)
-    : pid_(pid), procstat_(pid) {
+    : pid_(pid), last_hit_(SIZE_MAX), procstat_(pid) {
   if (option)
     std::memcpy(&symbol_option_, option, sizeof(bcc_symbol_option));
   else
@@ -125,11 +643,23 @@ int ProcSyms::_add_load_sections(uint64_t v_addr, uint64_t mem_sz,
 
 void ProcSyms::load_exe() {
   std::string exe = ebpf::get_pid_exe(pid_);
+  struct stat st;
+  uint64_t inode = stat(exe.c_str(), &st) == 0 ? st.st_ino : 0;
+
+  if (reuse_module(exe, exe, inode)) {
+    Module &module = modules_.back();
+    bcc_elf_foreach_load_section(exe.c_str(), &_add_load_sections, &module);
+    if (module.ranges_.empty())
+      modules_.pop_back();
+    return;
+  }
+
   Module module(exe.c_str(), exe.c_str(), &symbol_option_);
 
   if (module.type_ != ModuleType::EXEC)
     return;
 
+  module.inode_ = inode;
 
   bcc_elf_foreach_load_section(exe.c_str(), &_add_load_sections, &module);
 
@@ -137,14 +667,121 @@ void ProcSyms::load_exe() {
     modules_.emplace_back(std::move(module));
 }
 
+bool ProcSyms::reuse_module(const std::string &name, const std::string &path,
+                            uint64_t inode) {
+  auto it = stale_modules_.find(name);
+  if (it == stale_modules_.end())
+    return false;
+
+  Module &module = it->second;
+  bool same_file = module.path_ == path && module.inode_ == inode;
+  if (same_file) {
+    // Symbols are file-relative, so the loaded table stays valid; only the
+    // address ranges are taken from the new mappings.
+    module.ranges_.clear();
+    modules_.push_back(std::move(module));
+  }
+  stale_modules_.erase(it);
+  return same_file;
+}
+
 void ProcSyms::load_modules() {
   load_exe();
   bcc_procutils_each_module(pid_, _add_module, this);
+  build_range_idx();
+}
+
+void ProcSyms::build_range_idx() {
+  range_idx_.clear();
+  perf_maps_.clear();
+  last_hit_ = SIZE_MAX;
+
+  for (size_t i = 0; i < modules_.size(); i++) {
+    const Module &mod = modules_[i];
+    if (mod.type_ == ModuleType::PERF_MAP) {
+      perf_maps_.push_back(i);
+      continue;
+    }
+    for (size_t j = 0; j < mod.ranges_.size(); j++)
+      range_idx_.push_back(
+          {mod.ranges_[j].start, mod.ranges_[j].end, 0, i, j});
+  }
+
+  std::sort(range_idx_.begin(), range_idx_.end(),
+            [](const RangeIdx &a, const RangeIdx &b) {
+              return a.start < b.start;
+            });
+  uint64_t max_end = 0;
+  for (auto &r : range_idx_) {
+    max_end = std::max(max_end, r.end);
+    r.max_end = max_end;
+  }
+}
+
+const ProcSyms::SymbolTable *ProcSyms::module_table(uint64_t addr) {
+  uint64_t offset;
+  Module *mod = find_module(addr, offset);
+  return mod ? mod->table_.get() : nullptr;
+}
+
+ProcSyms::Module *ProcSyms::find_module(uint64_t addr, uint64_t &offset) {
+  const RangeIdx *hit = nullptr;
+
+  // Consecutive stacks tend to hit the same few hot modules.
+  if (last_hit_ < range_idx_.size()) {
+    const RangeIdx &r = range_idx_[last_hit_];
+    if (addr >= r.start && addr < r.end)
+      hit = &r;
+  }
+
+  if (!hit) {
+    auto it = std::upper_bound(
+        range_idx_.begin(), range_idx_.end(), addr,
+        [](uint64_t addr, const RangeIdx &r) { return addr < r.start; });
+    // Ranges may overlap, e.g. the executable's load sections and its
+    // mappings. Pick the first matching range in module order, like a linear
+    // scan over modules_ and their ranges would.
+    size_t matches = 0;
+    bool same_module = true;
+    while (it != range_idx_.begin()) {
+      --it;
+      if (it->max_end <= addr)
+        break;
+      if (addr >= it->end)
+        continue;
+      matches++;
+      if (hit && hit->module != it->module)
+        same_module = false;
+      if (!hit || it->module < hit->module ||
+          (it->module == hit->module && it->range < hit->range))
+        hit = &*it;
+    }
+    if (!hit)
+      return nullptr;
+
+    // Only remember hits whose result doesn't depend on which of several
+    // overlapping ranges matched; offsets within executables don't.
+    if (matches == 1 ||
+        (same_module && modules_[hit->module].type_ == ModuleType::EXEC))
+      last_hit_ = hit - range_idx_.data();
+  }
+
+  Module &mod = modules_[hit->module];
+  offset = mod.offset_of(mod.ranges_[hit->range], addr);
+  return &mod;
 }
 
 void ProcSyms::refresh() {
+  // Keep modules whose file is still mapped, so their symbols need not be
+  // loaded again. Perf maps are always reloaded, since JITs keep appending
+  // to them.
+  for (Module &mod : modules_) {
+    if (mod.type_ != ModuleType::PERF_MAP)
+      stale_modules_.emplace(mod.name_, std::move(mod));
+  }
   modules_.clear();
   load_modules();
+  stale_modules_.clear();
   procstat_.reset();
 }
 
@@ -155,9 +792,13 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
   auto it = std::find_if(
       ps->modules_.begin(), ps->modules_.end(),
       [=](const ProcSyms::Module &m) { return m.name_ == mod->name; });
+  if (it == ps->modules_.end() &&
+      ps->reuse_module(mod->name, modpath, mod->inode))
+    it = ps->modules_.end() - 1;
   if (it == ps->modules_.end()) {
     auto module = Module(
         mod->name, modpath, &ps->symbol_option_);
+    module.inode_ = mod->inode;
 
     // pid/maps doesn't account for file_offset of text within the ELF.
     // It only gives the mmap offset. We need the real offset for symbol
@@ -187,6 +828,14 @@ int ProcSyms::_add_module(mod_info *mod, int enter_ns, void *payload) {
   return 0;
 }
 
+static void demangle_symbol(struct bcc_symbol *sym) {
+  if (sym->name && (!strncmp(sym->name, "_Z", 2) || !strncmp(sym->name, "___Z", 4)))
+    sym->demangle_name =
+        abi::__cxa_demangle(sym->name, nullptr, nullptr, nullptr);
+  if (!sym->demangle_name)
+    sym->demangle_name = sym->name;
+}
+
 bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
                             bool demangle) {
   if (procstat_.is_stale())
@@ -194,38 +843,28 @@ bool ProcSyms::resolve_addr(uint64_t addr, struct bcc_symbol *sym,
 
   memset(sym, 0, sizeof(struct bcc_symbol));
 
-  const char *original_module = nullptr;
   uint64_t offset;
-  bool only_perf_map = false;
-  for (Module &mod : modules_) {
-    if (only_perf_map && (mod.type_ != ModuleType::PERF_MAP))
-      continue;
-    if (mod.contains(addr, offset)) {
-      if (mod.find_addr(offset, sym)) {
-        if (demangle) {
-          if (sym->name && (!strncmp(sym->name, "_Z", 2) || !strncmp(sym->name, "___Z", 4)))
-            sym->demangle_name =
-                abi::__cxa_demangle(sym->name, nullptr, nullptr, nullptr);
-          if (!sym->demangle_name)
-            sym->demangle_name = sym->name;
-        }
-        return true;
-      } else if (mod.type_ != ModuleType::PERF_MAP) {
-        // In this case, we found the address in the range of a module, but
-        // not able to find a symbol of that address in the module.
-        // Thus, we would try to find the address in perf map, and
-        // save the module's name in case we will need it later.
-        original_module = mod.name_.c_str();
-        only_perf_map = true;
-      }
+  Module *mod = find_module(addr, offset);
+  if (mod && mod->find_addr(offset, sym)) {
+    if (demangle)
+      demangle_symbol(sym);
+    return true;
+  }
+
+  // In this case, we either found the address in the range of a module but
+  // were not able to find a symbol of that address in the module, or no
+  // module contains it at all. Try the perf maps, and if the symbol is not
+  // there either, report the module whose range contained the address.
+  for (size_t i : perf_maps_) {
+    Module &pm = modules_[i];
+    if (pm.contains(addr, offset) && pm.find_addr(offset, sym)) {
+      if (demangle)
+        demangle_symbol(sym);
+      return true;
     }
   }
-  // If we didn't find the symbol anywhere, the module name is probably
-  // set to be the perf map's name as it would be the last we tried.
-  // In this case, if we have found the address previously in a module,
-  // report the saved original module name instead.
-  if (original_module)
-    sym->module = original_module;
+  if (mod)
+    sym->module = mod->name_.c_str();
   return false;
 }
 
@@ -245,7 +884,7 @@ ProcSyms::Module::Module(const char *name, const char *path,
     struct bcc_symbol_option *option)
     : name_(name),
       path_(path),
-      loaded_(false),
+      inode_(0),
       symbol_option_(option),
       type_(ModuleType::UNKNOWN) {
   int elf_type = bcc_elf_get_type(path_.c_str());
@@ -270,56 +909,99 @@ ProcSyms::Module::Module(const char *name, const char *path,
 
 int ProcSyms::Module::_add_symbol(const char *symname, uint64_t start,
                                   uint64_t size, void *p) {
-  Module *m = static_cast<Module *>(p);
-  auto res = m->symnames_.emplace(symname);
-  m->syms_.emplace_back(&*(res.first), start, size);
+  SymbolTable *t = static_cast<SymbolTable *>(p);
+  auto res = t->symnames_.emplace(symname);
+  t->syms_.emplace_back(&*(res.first), start, size);
   return 0;
 }
 
 int ProcSyms::Module::_add_symbol_lazy(size_t section_idx, size_t str_table_idx,
                                        size_t str_len, uint64_t start,
                                        uint64_t size, int debugfile, void *p) {
-  Module *m = static_cast<Module *>(p);
-  m->syms_.emplace_back(
+  SymbolTable *t = static_cast<SymbolTable *>(p);
+  t->syms_.emplace_back(
       section_idx, str_table_idx, str_len, start, size, debugfile);
   return 0;
 }
 
+std::shared_ptr<ProcSyms::SymbolTable> ProcSyms::Module::shared_table() const {
+  static std::mutex store_mutex;
+  static std::unordered_map<std::string, std::weak_ptr<SymbolTable>> store;
+  static size_t sweep_at = 64;
+
+  // The same file may be reached through different paths (e.g. via
+  // /proc/PID/root), so identify it by what stat() reports instead.
+  // Tables also differ in whether, and from where, they use a SymbolIndex.
+  struct stat st;
+  if (stat(path_.c_str(), &st) < 0)
+    return std::make_shared<SymbolTable>();
+  const char *index_dir = getenv("BCC_SYM_INDEX_DIR");
+  std::string key = tfm::format(
+      "%lx:%lx:%lx.%lx:%lx:%x:%d%d%d:%s", (uint64_t)st.st_dev,
+      (uint64_t)st.st_ino, (uint64_t)st.st_mtim.tv_sec,
+      (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_size,
+      symbol_option_->use_symbol_type, symbol_option_->use_debug_file,
+      symbol_option_->check_debug_file_crc, symbol_option_->lazy_symbolize,
+      index_dir ? index_dir : "");
+
+  std::lock_guard<std::mutex> lock(store_mutex);
+  std::weak_ptr<SymbolTable> &slot = store[key];
+  std::shared_ptr<SymbolTable> table = slot.lock();
+  if (table)
+    return table;
+  table = std::make_shared<SymbolTable>();
+  slot = table;
+
+  // Drop entries of binaries no ProcSyms refers to anymore.
+  if (store.size() >= sweep_at) {
+    for (auto it = store.begin(); it != store.end();) {
+      if (it->second.expired())
+        it = store.erase(it);
+      else
+        ++it;
+    }
+    sweep_at = std::max<size_t>(64, store.size() * 2);
+  }
+  return table;
+}
+
 void ProcSyms::Module::load_sym_table() {
-  if (loaded_)
+  if (table_)
     return;
-  loaded_ = true;
+
+  bool is_elf = type_ == ModuleType::EXEC || type_ == ModuleType::SO;
+  table_ = is_elf ? shared_table() : std::make_shared<SymbolTable>();
+
+  SymbolTable *t = table_.get();
+  std::lock_guard<std::mutex> lock(t->mutex_);
+  if (t->loaded_)
+    return;
+  t->loaded_ = true;
 
   if (type_ == ModuleType::UNKNOWN)
     return;
 
   if (type_ == ModuleType::PERF_MAP)
-    bcc_perf_map_foreach_sym(path_.c_str(), _add_symbol, this);
-  if (type_ == ModuleType::EXEC || type_ == ModuleType::SO) {
+    bcc_perf_map_foreach_sym(path_.c_str(), _add_symbol, t);
+  if (is_elf) {
+    t->index_ = SymbolIndex::load(path_, symbol_option_);
+    if (t->index_)
+      return;
     if (symbol_option_->lazy_symbolize)
-      bcc_elf_foreach_sym_lazy(path_.c_str(), _add_symbol_lazy, symbol_option_, this);
+      bcc_elf_foreach_sym_lazy(path_.c_str(), _add_symbol_lazy, symbol_option_, t);
     else
-      bcc_elf_foreach_sym(path_.c_str(), _add_symbol, symbol_option_, this);
+      bcc_elf_foreach_sym(path_.c_str(), _add_symbol, symbol_option_, t);
   }
   if (type_ == ModuleType::VDSO)
-    bcc_elf_foreach_vdso_sym(_add_symbol, this);
+    bcc_elf_foreach_vdso_sym(_add_symbol, t);
 
-  std::sort(syms_.begin(), syms_.end());
+  std::sort(t->syms_.begin(), t->syms_.end());
 }
 
 bool ProcSyms::Module::contains(uint64_t addr, uint64_t &offset) const {
   for (const auto &range : ranges_) {
     if (addr >= range.start && addr < range.end) {
-      if (type_ == ModuleType::SO || type_ == ModuleType::VDSO) {
-        // Offset within the mmap
-        offset = addr - range.start + range.file_offset;
-
-        // Offset within the ELF for SO symbol lookup
-        offset += (elf_so_addr_ - elf_so_offset_);
-      } else {
-        offset = addr;
-      }
-
+      offset = offset_of(range, addr);
       return true;
     }
   }
@@ -327,6 +1009,17 @@ bool ProcSyms::Module::contains(uint64_t addr, uint64_t &offset) const {
   return false;
 }
 
+uint64_t ProcSyms::Module::offset_of(const Range &range, uint64_t addr) const {
+  if (type_ == ModuleType::SO || type_ == ModuleType::VDSO) {
+    // Offset within the mmap
+    uint64_t offset = addr - range.start + range.file_offset;
+
+    // Offset within the ELF for SO symbol lookup
+    return offset + (elf_so_addr_ - elf_so_offset_);
+  }
+  return addr;
+}
+
 bool ProcSyms::Module::find_name(const char *symname, uint64_t *addr) {
   struct Payload {
     const char *symname;
@@ -373,8 +1066,22 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
   sym->module = name_.c_str();
   sym->offset = offset;
 
-  auto it = std::upper_bound(syms_.begin(), syms_.end(), Symbol(nullptr, offset, 0));
-  if (it == syms_.begin())
+  SymbolTable &t = *table_;
+  if (t.index_) {
+    const SymbolIndex::Entry *e = t.index_->find(offset);
+    if (!e)
+      return false;
+    sym->name = t.index_->name(*e);
+    sym->offset = offset - e->start;
+    return true;
+  }
+
+  // Lazily loaded symbols have their names filled in on first use, which
+  // may race with other ProcSyms sharing this table.
+  std::lock_guard<std::mutex> lock(t.mutex_);
+
+  auto it = std::upper_bound(t.syms_.begin(), t.syms_.end(), Symbol(nullptr, offset, 0));
+  if (it == t.syms_.begin())
     return false;
 
   // 'it' points to the symbol whose start address is strictly greater than
@@ -409,7 +1116,7 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
               it->data.name_idx.debugfile))
           break;
 
-        it->data.name = &*(symnames_.emplace(std::move(sym_name)).first);
+        it->data.name = &*(t.symnames_.emplace(std::move(sym_name)).first);
         it->is_name_resolved = true;
       }
 
@@ -420,7 +1127,7 @@ bool ProcSyms::Module::find_addr(uint64_t offset, struct bcc_symbol *sym) {
     if (limit > it->start + it->size)
       break;
     // But don't step beyond begin()!
-    if (it == syms_.begin())
+    if (it == t.syms_.begin())
       break;
   }
 
@@ -439,8 +1146,11 @@ bool BuildSyms::Module::load_sym_table()
     .use_symbol_type = (1 << STT_FUNC) | (1 << STT_GNU_IFUNC)
   };
 
-  bcc_elf_foreach_sym(module_name_.c_str(), _add_symbol, &symbol_option_, this);
-  std::sort(syms_.begin(), syms_.end());
+  index_ = SymbolIndex::load(module_name_, &symbol_option_);
+  if (!index_) {
+    bcc_elf_foreach_sym(module_name_.c_str(), _add_symbol, &symbol_option_, this);
+    std::sort(syms_.begin(), syms_.end());
+  }
 
   for(std::vector<Symbol>::iterator it = syms_.begin();
       it != syms_.end(); ++it++) {
@@ -465,6 +1175,18 @@ bool BuildSyms::Module::resolve_addr(uint64_t offset, struct bcc_symbol* sym,
 
   load_sym_table();
 
+  if (index_) {
+    const SymbolIndex::Entry *e = index_->floor(offset);
+    if (!e)
+      goto unknown_symbol;
+    sym->name = index_->name(*e);
+    if (demangle)
+      sym->demangle_name = sym->name;
+    sym->offset = offset - e->start;
+    sym->module = module_name_.c_str();
+    return true;
+  }
+
   if (syms_.empty())
     goto unknown_symbol;
 
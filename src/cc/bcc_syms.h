@@ -67,6 +67,7 @@ int bcc_symcache_resolve_no_demangle(void *symcache, uint64_t addr,
 
 int bcc_symcache_resolve_name(void *resolver, const char *module,
                               const char *name, uint64_t *addr);
+// Invalidates the name and module pointers of symbols resolved so far.
 void bcc_symcache_refresh(void *resolver);
 
 int _bcc_syms_find_module(struct mod_info *info, int enter_ns, void *p);
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include <fcntl.h>
+#include <malloc.h>
 #include <map>
 #include <string>
 #include <sys/stat.h>
@@ -46,6 +47,7 @@
 #include "libbpf.h"
 #include "bcc_btf.h"
 #include "bcc_libbpf_inc.h"
+#include "phase_stats.h"
 
 namespace ebpf {
 
@@ -104,7 +106,7 @@ BPFModule::BPFModule(unsigned flags, TableStorage *ts, bool rw_engine_enabled,
       ctx_(new LLVMContext),
       id_(std::to_string((uintptr_t)this)),
       maps_ns_(maps_ns),
-      ts_(ts), btf_(nullptr) {
+      ts_(ts), btf_(nullptr), foreign_tables_(0) {
   ifindex_ = dev_name ? if_nametoindex(dev_name) : 0;
   initialize_rw_engine();
   LLVMInitializeBPFTarget();
@@ -124,6 +126,14 @@ BPFModule::BPFModule(unsigned flags, TableStorage *ts, bool rw_engine_enabled,
   func_src_ = ebpf::make_unique<FuncSource>();
 }
 
+int BPFModule::use_private_table_storage() {
+  if (!local_ts_ || !tables_.empty() || !sections_.empty())
+    return -1;
+  local_ts_ = createPrivateTableStorage();
+  ts_ = &*local_ts_;
+  return 0;
+}
+
 static StatusTuple unimplemented_sscanf(const char *, void *) {
   return StatusTuple(-1, "sscanf unimplemented");
 }
@@ -131,13 +141,16 @@ static StatusTuple unimplemented_snprintf(char *, size_t, const void *) {
   return StatusTuple(-1, "snprintf unimplemented");
 }
 
+void BPFModule::unimplement_rw(TableDesc &desc) {
+  desc.key_sscanf = unimplemented_sscanf;
+  desc.leaf_sscanf = unimplemented_sscanf;
+  desc.key_snprintf = unimplemented_snprintf;
+  desc.leaf_snprintf = unimplemented_snprintf;
+}
+
 BPFModule::~BPFModule() {
-  for (auto &v : tables_) {
-    v->key_sscanf = unimplemented_sscanf;
-    v->leaf_sscanf = unimplemented_sscanf;
-    v->key_snprintf = unimplemented_snprintf;
-    v->leaf_snprintf = unimplemented_snprintf;
-  }
+  for (auto &v : tables_)
+    unimplement_rw(*v);
 
   if (!rw_engine_enabled_) {
     for (auto section : sections_)
@@ -159,6 +172,69 @@ int BPFModule::free_bcc_memory() {
   return bcc_free_memory();
 }
 
+static size_t heap_in_use() {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+  struct mallinfo mi = mallinfo();
+  return (size_t)(unsigned)mi.uordblks + (unsigned)mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+void BPFModule::compact(CompactStats *stats) {
+  std::lock_guard<std::mutex> lock(rw_mutex_);
+  size_t heap_before = heap_in_use();
+
+  for (auto &v : tables_)
+    unimplement_rw(*v);
+
+  // Keep the programs, plus the license and version they are loaded with.
+  // In rw mode the sections still live in engine_, copy those out first.
+  size_t image_size = 0;
+  for (auto it = sections_.begin(); it != sections_.end();) {
+    uint8_t *addr = get<0>(it->second);
+    uintptr_t size = get<1>(it->second);
+    if (strncmp(FN_PREFIX.c_str(), it->first.c_str(), FN_PREFIX.size()) &&
+        it->first != "license" && it->first != "version") {
+      if (!rw_engine_enabled_)
+        delete[] addr;
+      it = sections_.erase(it);
+      continue;
+    }
+    if (rw_engine_enabled_ && addr) {
+      uint8_t *copy = new uint8_t[size];
+      memcpy(copy, addr, size);
+      get<0>(it->second) = copy;
+    }
+    image_size += size;
+    ++it;
+  }
+  // From here on the module owns its sections, as without the rw_engine.
+  rw_engine_enabled_ = false;
+
+  engine_.reset();
+  cleanup_rw_engine();
+  readers_.clear();
+  writers_.clear();
+  mod_.reset();
+  ctx_.reset();
+  func_src_->clear();
+  string().swap(mod_src_);
+  src_dbg_fmap_.clear();
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+
+  if (stats) {
+    stats->heap_before = heap_before;
+    stats->heap_after = heap_in_use();
+    stats->image_size = image_size;
+  }
+}
+
 // load an entire c file as a module
 int BPFModule::load_cfile(const string &file, bool in_memory, const char *cflags[], int ncflags) {
   ClangLoader clang_loader(&*ctx_, flags_);
@@ -190,6 +266,7 @@ void BPFModule::annotate_light() {
   Path path({id_});
   for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
     TableDesc &table = it->second;
+    unimplement_rw(table);
     tables_.push_back(&it->second);
     table_names_[table.name] = id++;
   }
@@ -202,6 +279,7 @@ void BPFModule::dump_ir(Module &mod) {
 }
 
 int BPFModule::run_pass_manager(Module &mod) {
+  PhaseTimer timer("llvm.passes", id_);
   if (verifyModule(mod, &errs())) {
     if (flags_ & DEBUG_LLVM_IR)
       dump_ir(mod);
@@ -276,6 +354,7 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
                            std::map<int, int> &map_fds,
                            std::map<std::string, int> &inner_map_fds,
                            bool for_inner_map) {
+  PhaseTimer timer("create_maps", id_);
   std::set<std::string> inner_maps;
   if (for_inner_map) {
     for (auto map : fake_fd_map_) {
@@ -355,6 +434,7 @@ int BPFModule::create_maps(std::map<std::string, std::pair<int, int>> &map_tids,
 }
 
 int BPFModule::load_maps(sec_map_def &sections) {
+  PhaseTimer timer("load_maps", id_);
   // find .maps.<table_name> sections and retrieve all map key/value type id's
   std::map<std::string, std::pair<int, int>> map_tids;
   if (btf_) {
@@ -406,13 +486,26 @@ int BPFModule::load_maps(sec_map_def &sections) {
   if (create_maps(map_tids, map_fds, inner_map_fds, false) < 0)
     return -1;
 
-  // update map table fd's
-  for (auto it = ts_->begin(), up = ts_->end(); it != up; ++it) {
+  // update map table fd's. Fake fds are only unique within a module, so
+  // only touch this module's tables, and the copies it exported under their
+  // own name or maps namespace.
+  Path path({id_});
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up;
+       ++it) {
     TableDesc &table = it->second;
-    if (map_fds.find(table.fake_fd) != map_fds.end()) {
-      table.fd = map_fds[table.fake_fd];
-      table.fake_fd = 0;
+    auto fd = map_fds.find(table.fake_fd);
+    if (table.fake_fd == 0 || fd == map_fds.end())
+      continue;
+    for (Path shared : {Path({table.name}), Path({"ns", maps_ns_, table.name})}) {
+      TableStorage::iterator shared_it;
+      if (ts_->Find(shared, shared_it) &&
+          shared_it->second.fake_fd == table.fake_fd) {
+        shared_it->second.fd = fd->second;
+        shared_it->second.fake_fd = 0;
+      }
     }
+    table.fd = fd->second;
+    table.fake_fd = 0;
   }
 
   // update instructions
@@ -441,6 +534,7 @@ int BPFModule::load_maps(sec_map_def &sections) {
 }
 
 int BPFModule::finalize() {
+  PhaseTimer timer("finalize", id_);
   Module *mod = &*mod_;
   sec_map_def tmp_sections,
       *sections_p;
@@ -487,6 +581,11 @@ int BPFModule::finalize() {
 
   engine_->finalizeObject();
 
+  // Snapshot the object before load_btf() and load_maps() patch it in place.
+  save_cached_object(*sections_p);
+  if (!object_save_file_.empty())
+    return write_saved_object(*sections_p);
+
   if (flags_ & DEBUG_SOURCE) {
     SourceDebugger src_debugger(mod, *sections_p, FN_PREFIX, mod_src_,
                                 src_dbg_fmap_);
@@ -574,6 +673,11 @@ int BPFModule::annotate_prog_tag(const string &name, int prog_fd,
     return -1;
   }
 
+  // Compacted modules, and ones restored from an object, have no sources
+  // left. Keep whatever an earlier load saved for the tag.
+  if (!*function_source(name))
+    return 0;
+
   err = mkdir(BCC_PROG_TAG_DIR, 0777);
   if (err && errno != EEXIST) {
     fprintf(stderr, "cannot create " BCC_PROG_TAG_DIR "\n");
@@ -588,39 +692,36 @@ int BPFModule::annotate_prog_tag(const string &name, int prog_fd,
     return -1;
   }
 
+  // Functions may be loaded concurrently, and several modules may hold the
+  // same program, so only ever look up the sources and replace the files
+  // whole.
+  auto write_src = [](const char *path, const char *src) {
+    if (!write_private_file(path, [src](int fd, const string &) {
+          size_t len = strlen(src);
+          return ::write(fd, src, len) == (ssize_t)len;
+        }, 0644)) {
+      fprintf(stderr, "cannot create %s\n", path);
+      return false;
+    }
+    return true;
+  };
+
   ::snprintf(buf, sizeof(buf), BCC_PROG_TAG_DIR "/bpf_prog_%llx/%s.c",
              tag1, name.data());
-  FileDesc fd(open(buf, O_CREAT | O_WRONLY | O_TRUNC, 0644));
-  if (fd < 0) {
-    fprintf(stderr, "cannot create %s\n", buf);
+  if (!write_src(buf, function_source(name)))
     return -1;
-  }
-
-  const char *src = function_source(name);
-  write(fd, src, strlen(src));
 
   ::snprintf(buf, sizeof(buf), BCC_PROG_TAG_DIR "/bpf_prog_%llx/%s.rewritten.c",
              tag1, name.data());
-  fd = open(buf, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-  if (fd < 0) {
-    fprintf(stderr, "cannot create %s\n", buf);
+  if (!write_src(buf, function_source_rewritten(name)))
     return -1;
-  }
 
-  src = function_source_rewritten(name);
-  write(fd, src, strlen(src));
-
-  if (!src_dbg_fmap_[name].empty()) {
+  auto dbg = src_dbg_fmap_.find(name);
+  if (dbg != src_dbg_fmap_.end() && !dbg->second.empty()) {
     ::snprintf(buf, sizeof(buf), BCC_PROG_TAG_DIR "/bpf_prog_%llx/%s.dis.txt",
                tag1, name.data());
-    fd = open(buf, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (fd < 0) {
-      fprintf(stderr, "cannot create %s\n", buf);
+    if (!write_src(buf, dbg->second.c_str()))
       return -1;
-    }
-
-    const char *src = src_dbg_fmap_[name].c_str();
-    write(fd, src, strlen(src));
   }
 
   return 0;
@@ -889,6 +990,15 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
     fprintf(stderr, "Program already initialized\n");
     return -1;
   }
+
+  object_cache_file_ = object_cache_path(text, cflags, ncflags);
+  if (!object_cache_file_.empty()) {
+    int rc = restore_object(object_cache_file_, true);
+    if (rc <= 0)
+      return rc;
+    foreign_tables_ = count_foreign_tables();
+  }
+
   if (int rc = load_cfile(text, true, cflags, ncflags))
     return rc;
   if (rw_engine_enabled_) {
@@ -903,6 +1013,54 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
   return 0;
 }
 
+int BPFModule::save_object(const string &path, const string &text,
+                           const char *cflags[], int ncflags) {
+  if (!sections_.empty()) {
+    fprintf(stderr, "Program already initialized\n");
+    return -1;
+  }
+
+  // The saved object is restored without LLVM types, see load_object().
+  rw_engine_enabled_ = false;
+  object_save_file_ = path;
+  foreign_tables_ = count_foreign_tables();
+  if (int rc = load_cfile(text, true, cflags, ncflags))
+    return rc;
+  annotate_light();
+  return finalize();
+}
+
+int BPFModule::load_object(const string &path) {
+  if (!sections_.empty()) {
+    fprintf(stderr, "Program already initialized\n");
+    return -1;
+  }
+
+  // There are no LLVM types to build table readers and writers from.
+  rw_engine_enabled_ = false;
+  int rc = restore_object(path, false);
+  if (rc > 0)
+    fprintf(stderr, "Could not load BPF object %s\n", path.c_str());
+  return rc ? -1 : 0;
+}
+
+// Instructions processed by the verifier for a loaded program, as reported in
+// its fdinfo since Linux 5.16, or 0.
+static uint64_t prog_verified_insns(int prog_fd) {
+  char path[64];
+  ::snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", prog_fd);
+  FILE *f = fopen(path, "re");
+  if (!f)
+    return 0;
+  char line[128];
+  unsigned long long insns = 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "verified_insns: %llu", &insns) == 1)
+      break;
+  fclose(f);
+  return insns;
+}
+
 int BPFModule::bcc_func_load(int prog_type, const char *name,
                 const struct bpf_insn *insns, int prog_len,
                 const char *license, unsigned kern_version,
@@ -945,7 +1103,13 @@ int BPFModule::bcc_func_load(int prog_type, const char *name,
     }
   }
 
+  PhaseTimer timer("prog_load", name);
   ret = bcc_prog_load_xattr(&attr, prog_len, log_buf, log_buf_size, allow_rlimit_);
+  if (timer.active()) {
+    timer.stats().insn_cnt = prog_len / sizeof(struct bpf_insn);
+    if (ret >= 0)
+      timer.stats().verified_insns = prog_verified_insns(ret);
+  }
   if (btf_) {
     free(func_info);
     free(line_info);
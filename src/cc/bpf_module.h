@@ -19,6 +19,7 @@
 #include <stdint.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -55,6 +56,14 @@ enum {
   DEBUG_BTF = 0x20,
 };
 
+// Heap in use by the process around BPFModule::compact(), as malloc
+// reports it, and the size of the program image kept by the module.
+struct CompactStats {
+  size_t heap_before;
+  size_t heap_after;
+  size_t image_size;
+};
+
 class TableDesc;
 class TableStorage;
 class BLoader;
@@ -74,7 +83,10 @@ class BPFModule {
   int finalize();
   int annotate();
   void annotate_light();
-  std::unique_ptr<llvm::ExecutionEngine> finalize_rw(std::unique_ptr<llvm::Module> mod);
+  // Makes a table's string conversions fail rather than call a missing
+  // reader or writer.
+  static void unimplement_rw(TableDesc &desc);
+  void *rw_function(llvm::Type *type, bool writer);
   std::string make_reader(llvm::Module *mod, llvm::Type *type);
   std::string make_writer(llvm::Module *mod, llvm::Type *type);
   void dump_ir(llvm::Module &mod);
@@ -83,8 +95,8 @@ class BPFModule {
   int load_cfile(const std::string &file, bool in_memory, const char *cflags[], int ncflags);
   int kbuild_flags(const char *uname_release, std::vector<std::string> *cflags);
   int run_pass_manager(llvm::Module &mod);
-  StatusTuple sscanf(std::string fn_name, const char *str, void *val);
-  StatusTuple snprintf(std::string fn_name, char *str, size_t sz,
+  StatusTuple sscanf(llvm::Type *type, const char *str, void *val);
+  StatusTuple snprintf(llvm::Type *type, char *str, size_t sz,
                        const void *val);
   void load_btf(sec_map_def &sections);
   int load_maps(sec_map_def &sections);
@@ -92,16 +104,41 @@ class BPFModule {
                   std::map<int, int> &map_fds,
                   std::map<std::string, int> &inner_map_fds,
                   bool for_inner_map);
+  std::string object_cache_path(const std::string &text, const char *cflags[],
+                                int ncflags) const;
+  size_t count_foreign_tables();
+  bool object_cacheable();
+  std::string serialize_object(const sec_map_def &sections);
+  int restore_object(const std::string &file, bool private_only);
+  void save_cached_object(const sec_map_def &sections);
+  int write_saved_object(const sec_map_def &sections);
 
  public:
   BPFModule(unsigned flags, TableStorage *ts = nullptr, bool rw_engine_enabled = true,
             const std::string &maps_ns = "", bool allow_rlimit = true,
             const char *dev_name = nullptr);
   ~BPFModule();
+  // Moves the tables of a module created without a TableStorage from the
+  // process-wide storage to storage of its own, see
+  // createPrivateTableStorage(). Only possible before anything is loaded.
+  int use_private_table_storage();
   int free_bcc_memory();
+  // Frees all LLVM and clang state, sources and sections other than the
+  // programs once loading is done, keeping the programs, BTF and tables.
+  // Tables can no longer be converted to or from strings afterwards, and
+  // functions loaded afterwards don't save their sources by program tag.
+  void compact(CompactStats *stats = nullptr);
   int load_b(const std::string &filename, const std::string &proto_filename);
   int load_c(const std::string &filename, const char *cflags[], int ncflags);
   int load_string(const std::string &text, const char *cflags[], int ncflags);
+  // Compiles text like load_string(), but writes the finalized object to path
+  // for load_object() instead of creating maps, so that programs can be built
+  // once, without BPF privileges, and shipped to hosts without clang. The
+  // object keeps the kernel version of the headers it was compiled against.
+  int save_object(const std::string &path, const std::string &text,
+                  const char *cflags[], int ncflags);
+  // Loads an object written by save_object() in place of load_string().
+  int load_object(const std::string &path);
   std::string id() const { return id_; }
   std::string maps_ns() const { return maps_ns_; }
   size_t num_functions() const;
@@ -161,7 +198,9 @@ class BPFModule {
   std::string proto_filename_;
   std::unique_ptr<llvm::LLVMContext> ctx_;
   std::unique_ptr<llvm::ExecutionEngine> engine_;
+  // Table key and leaf readers and writers, JITed on first use.
   std::unique_ptr<llvm::ExecutionEngine> rw_engine_;
+  std::mutex rw_mutex_;
   std::unique_ptr<llvm::Module> mod_;
   std::unique_ptr<FuncSource> func_src_;
   sec_map_def sections_;
@@ -182,6 +221,13 @@ class BPFModule {
 
   // map of events -- key: event name, value: event fields
   std::map<std::string, std::vector<std::string>> perf_events_;
+
+  // Compiled-object cache entry to fill in once compilation succeeds, and
+  // the number of tables outside this module before compiling.
+  std::string object_cache_file_;
+  size_t foreign_tables_;
+  // Object file to write by save_object() in place of creating maps.
+  std::string object_save_file_;
 };
 
 }  // namespace ebpf
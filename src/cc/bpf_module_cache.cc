@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/SHA1.h>
+
+#include "bcc_version.h"
+#include "bpf_module.h"
+#include "common.h"
+#include "exported_files.h"
+#include "file_desc.h"
+#include "frontends/clang/loader.h"
+#include "table_storage.h"
+
+namespace ebpf {
+
+using std::get;
+using std::make_tuple;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Compiled objects are stored as a flat sequence of little-endian integers
+// and length-prefixed byte strings, starting with this magic and version.
+const char kObjectMagic[8] = {'B', 'C', 'C', 'O', 'B', 'J', '\0', '\0'};
+const uint32_t kObjectVersion = 2;
+
+class ObjectWriter {
+ public:
+  void u32(uint32_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void u64(uint64_t v) { buf_.append((const char *)&v, sizeof(v)); }
+  void bytes(const void *p, size_t n) {
+    u64(n);
+    buf_.append((const char *)p, n);
+  }
+  void str(const string &s) { bytes(s.data(), s.size()); }
+  string &buf() { return buf_; }
+
+ private:
+  string buf_;
+};
+
+class ObjectReader {
+ public:
+  explicit ObjectReader(const string &buf) : buf_(buf), pos_(0), ok_(true) {}
+  void raw(void *p, size_t n) { read(p, n); }
+  uint32_t u32() {
+    uint32_t v = 0;
+    read(&v, sizeof(v));
+    return v;
+  }
+  uint64_t u64() {
+    uint64_t v = 0;
+    read(&v, sizeof(v));
+    return v;
+  }
+  string str() {
+    uint64_t n = u64();
+    if (!ok_ || n > buf_.size() - pos_) {
+      ok_ = false;
+      return string();
+    }
+    string s = buf_.substr(pos_, n);
+    pos_ += n;
+    return s;
+  }
+  bool ok() const { return ok_; }
+  bool done() const { return ok_ && pos_ == buf_.size(); }
+
+ private:
+  void read(void *p, size_t n) {
+    if (!ok_ || n > buf_.size() - pos_) {
+      ok_ = false;
+      return;
+    }
+    memcpy(p, buf_.data() + pos_, n);
+    pos_ += n;
+  }
+
+  const string &buf_;
+  size_t pos_;
+  bool ok_;
+};
+
+// With private_only set, only files nobody but this user could have written are
+// read, as their contents end up loaded into the kernel.
+bool read_file(const string &path, string &out, bool private_only) {
+  struct stat st;
+  FileDesc fd(private_only ? open_private_file(path, &st)
+                           : open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0 || (!private_only && fstat(fd, &st) < 0))
+    return false;
+  out.resize(st.st_size);
+  size_t done = 0;
+  while (done < out.size()) {
+    ssize_t n = read(fd, &out[done], out.size() - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+bool write_file(const string &path, const string &data, mode_t mode) {
+  return write_private_file(path, [&](int fd, const string &) {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n = write(fd, data.data() + done, data.size() - done);
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+    return true;
+  }, mode);
+}
+
+}  // namespace
+
+// Returns the cache file for a program, or an empty string if the program is
+// not to be cached. The key covers everything that feeds into compilation:
+// the program text and cflags, the kernel headers, the bcc exported headers
+// and the bcc/LLVM versions.
+string BPFModule::object_cache_path(const string &text, const char *cflags[],
+                                    int ncflags) const {
+  const char *dir = getenv("BCC_OBJ_CACHE_DIR");
+  if (!dir || !*dir)
+    return string();
+
+  // Debug output is produced while compiling, and a cached object has no
+  // LLVM types to build the rw_engine table readers and writers from.
+  if (flags_ || rw_engine_enabled_)
+    return string();
+
+  string key = string(kObjectMagic, sizeof(kObjectMagic));
+  key += std::to_string(kObjectVersion) + "\n";
+  key += LIBBCC_VERSION "\n" LLVM_VERSION_STRING "\n";
+  key += ClangLoader::kernel_headers_id() + "\n";
+  key += std::to_string(get_possible_cpus().size()) + "\n";
+  for (int i = 0; i < ncflags; i++) {
+    key += cflags[i];
+    key += '\0';
+  }
+  key += '\0';
+  for (auto *files : {&ExportedFiles::headers(), &ExportedFiles::footers()}) {
+    for (auto &f : *files) {
+      key += f.first;
+      key += '\0';
+      key += f.second;
+      key += '\0';
+    }
+  }
+  key += text;
+
+  auto hash = llvm::SHA1::hash(
+      llvm::ArrayRef<uint8_t>((const uint8_t *)key.data(), key.size()));
+  string name;
+  for (uint8_t b : hash) {
+    name += "0123456789abcdef"[b >> 4];
+    name += "0123456789abcdef"[b & 0xf];
+  }
+  return string(dir) + "/" + name + ".bccobj";
+}
+
+size_t BPFModule::count_foreign_tables() {
+  size_t n = 0;
+  for (auto it = ts_->begin(), up = ts_->end(); it != up; ++it)
+    n++;
+  Path path({id_});
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up;
+       ++it)
+    n--;
+  return n;
+}
+
+// A compiled object can only be reused if it does not depend on state outside
+// of the program: tables shared with other modules and pinned maps are
+// resolved to live file descriptors and IDs while compiling.
+bool BPFModule::object_cacheable() {
+  for (auto &map : fake_fd_map_)
+    if (get<6>(map.second))
+      return false;
+
+  Path path({id_});
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up;
+       ++it)
+    if (it->second.is_extern)
+      return false;
+
+  // Exported and shared tables are added outside of this module's path.
+  return count_foreign_tables() == foreign_tables_;
+}
+
+string BPFModule::serialize_object(const sec_map_def &sections) {
+  ObjectWriter w;
+  w.buf().append(kObjectMagic, sizeof(kObjectMagic));
+  w.u32(kObjectVersion);
+  w.u32(get_possible_cpus().size());
+
+  w.u64(sections.size());
+  for (auto &section : sections) {
+    w.str(section.first);
+    w.u32(get<2>(section.second));
+    w.u64(get<1>(section.second));
+    // Map sections carry no data, see finalize().
+    if (!strncmp("maps/", section.first.c_str(), 5))
+      w.u64(0);
+    else
+      w.bytes(get<0>(section.second), get<1>(section.second));
+  }
+
+  Path path({id_});
+  vector<TableDesc *> tables;
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up;
+       ++it)
+    tables.push_back(&it->second);
+  w.u64(tables.size());
+  for (TableDesc *t : tables) {
+    w.str(t->name);
+    w.u32(t->fake_fd);
+    w.u32(t->type);
+    w.u64(t->key_size);
+    w.u64(t->leaf_size);
+    w.u64(t->max_entries);
+    w.u32(t->flags);
+    w.str(t->key_desc);
+    w.str(t->leaf_desc);
+    w.u32(t->is_shared);
+  }
+
+  w.u64(fake_fd_map_.size());
+  for (auto &map : fake_fd_map_) {
+    w.u32(map.first);
+    w.u32(get<0>(map.second));
+    w.str(get<1>(map.second));
+    w.u32(get<2>(map.second));
+    w.u32(get<3>(map.second));
+    w.u32(get<4>(map.second));
+    w.u32(get<5>(map.second));
+    w.u32(get<6>(map.second));
+    w.str(get<7>(map.second));
+  }
+
+  w.u64(perf_events_.size());
+  for (auto &event : perf_events_) {
+    w.str(event.first);
+    w.u64(event.second.size());
+    for (auto &field : event.second)
+      w.str(field);
+  }
+
+  w.u64(func_src_->funcs().size());
+  for (auto &func : func_src_->funcs()) {
+    w.str(func.first);
+    w.str(func.second.src_);
+    w.str(func.second.src_rewritten_);
+  }
+
+  w.str(mod_src_);
+  return std::move(w.buf());
+}
+
+// Restores a module from a file written by serialize_object(), the way
+// finalize() would have left it, and then creates its maps. Returns 1 without
+// modifying the module if the file is missing or invalid, or with private_only
+// set, if anyone but this user could have written it.
+int BPFModule::restore_object(const string &file, bool private_only) {
+  string blob;
+  if (!read_file(file, blob, private_only))
+    return 1;
+
+  ObjectReader r(blob);
+  char magic[sizeof(kObjectMagic)];
+  r.raw(magic, sizeof(magic));
+  if (!r.ok() || memcmp(magic, kObjectMagic, sizeof(magic)) ||
+      r.u32() != kObjectVersion)
+    return 1;
+  uint32_t ncpus = r.u32();
+
+  struct Section {
+    string name;
+    unsigned id;
+    uint64_t size;
+    string data;
+  };
+  vector<Section> sections;
+  for (uint64_t n = r.u64(); n > 0 && r.ok(); n--) {
+    Section section;
+    section.name = r.str();
+    section.id = r.u32();
+    section.size = r.u64();
+    section.data = r.str();
+    bool is_map = !strncmp("maps/", section.name.c_str(), 5);
+    if (!is_map && section.data.size() != section.size)
+      return 1;
+    sections.push_back(std::move(section));
+  }
+
+  vector<TableDesc> tables;
+  for (uint64_t n = r.u64(); n > 0 && r.ok(); n--) {
+    TableDesc t;
+    t.name = r.str();
+    t.fake_fd = r.u32();
+    t.type = r.u32();
+    t.key_size = r.u64();
+    t.leaf_size = r.u64();
+    t.max_entries = r.u64();
+    t.flags = r.u32();
+    t.key_desc = r.str();
+    t.leaf_desc = r.str();
+    t.is_shared = r.u32();
+    // There are no LLVM types to build readers and writers from.
+    unimplement_rw(t);
+    tables.push_back(std::move(t));
+  }
+
+  fake_fd_map_def fake_fd_map;
+  for (uint64_t n = r.u64(); n > 0 && r.ok(); n--) {
+    int fake_fd = r.u32();
+    int type = r.u32();
+    string name = r.str();
+    int key_size = r.u32();
+    int value_size = r.u32();
+    int max_entries = r.u32();
+    int map_flags = r.u32();
+    unsigned int pinned_id = r.u32();
+    string inner_map_name = r.str();
+    fake_fd_map[fake_fd] = make_tuple(type, name, key_size, value_size,
+                                      max_entries, map_flags, pinned_id,
+                                      inner_map_name);
+  }
+
+  std::map<string, vector<string>> perf_events;
+  for (uint64_t n = r.u64(); n > 0 && r.ok(); n--) {
+    vector<string> &fields = perf_events[r.str()];
+    for (uint64_t m = r.u64(); m > 0 && r.ok(); m--)
+      fields.push_back(r.str());
+  }
+
+  vector<std::tuple<string, string, string>> funcs;
+  for (uint64_t n = r.u64(); n > 0 && r.ok(); n--) {
+    string name = r.str();
+    string src = r.str();
+    string src_rewritten = r.str();
+    funcs.emplace_back(name, src, src_rewritten);
+  }
+
+  string mod_src = r.str();
+  if (!r.done())
+    return 1;
+
+  // perf output arrays are sized to the CPUs of the host that compiled the
+  // program, which for saved objects need not be this one.
+  uint32_t cur_ncpus = get_possible_cpus().size();
+  if (ncpus != cur_ncpus && cur_ncpus > 0) {
+    for (auto &t : tables)
+      if (t.type == BPF_MAP_TYPE_PERF_EVENT_ARRAY && t.max_entries == ncpus)
+        t.max_entries = cur_ncpus;
+    for (auto &map : fake_fd_map)
+      if (get<0>(map.second) == BPF_MAP_TYPE_PERF_EVENT_ARRAY &&
+          get<4>(map.second) == (int)ncpus)
+        get<4>(map.second) = cur_ncpus;
+  }
+
+  for (auto &section : sections) {
+    uint8_t *data = nullptr;
+    if (strncmp("maps/", section.name.c_str(), 5)) {
+      data = new uint8_t[section.size];
+      memcpy(data, section.data.data(), section.size);
+    }
+    sections_[section.name] = make_tuple(data, section.size, section.id);
+  }
+
+  size_t id = 0;
+  for (auto &t : tables) {
+    string name = t.name;
+    ts_->Insert(Path({id_, name}), std::move(t));
+  }
+  Path path({id_});
+  for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up;
+       ++it) {
+    tables_.push_back(&it->second);
+    table_names_[it->second.name] = id++;
+  }
+
+  fake_fd_map_ = std::move(fake_fd_map);
+  perf_events_ = std::move(perf_events);
+  for (auto &func : funcs) {
+    func_src_->set_src(get<0>(func), get<1>(func));
+    func_src_->set_src_rewritten(get<0>(func), get<2>(func));
+  }
+  mod_src_ = std::move(mod_src);
+
+  load_btf(sections_);
+  if (load_maps(sections_))
+    return -1;
+
+  for (auto section : sections_)
+    if (!strncmp(FN_PREFIX.c_str(), section.first.c_str(), FN_PREFIX.size()))
+      function_names_.push_back(section.first);
+  return 0;
+}
+
+void BPFModule::save_cached_object(const sec_map_def &sections) {
+  if (object_cache_file_.empty() || !object_cacheable())
+    return;
+  write_file(object_cache_file_, serialize_object(sections), 0600);
+}
+
+int BPFModule::write_saved_object(const sec_map_def &sections) {
+  if (!object_cacheable()) {
+    fprintf(stderr, "Cannot save %s: shared, extern and pinned tables are "
+                    "resolved at compile time\n", object_save_file_.c_str());
+    return -1;
+  }
+  if (!write_file(object_save_file_, serialize_object(sections), 0644)) {
+    fprintf(stderr, "Could not write %s: %s\n", object_save_file_.c_str(),
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+}  // namespace ebpf
@@ -348,21 +348,40 @@ string BPFModule::make_writer(Module *mod, Type *type) {
   return name;
 }
 
-unique_ptr<ExecutionEngine> BPFModule::finalize_rw(unique_ptr<Module> m) {
-  Module *mod = &*m;
-
-  run_pass_manager(*mod);
-
-  string err;
-  EngineBuilder builder(move(m));
-  builder.setErrorStr(&err);
+// Returns the reader or writer for type, generating it and JITing it into
+// rw_engine_ on first use.
+void *BPFModule::rw_function(Type *type, bool writer) {
+  std::lock_guard<std::mutex> lock(rw_mutex_);
+
+  auto &fns = writer ? writers_ : readers_;
+  auto fn_it = fns.find(type);
+  string name;
+  if (fn_it != fns.end()) {
+    name = fn_it->second;
+  } else {
+    // separate module to hold the new function
+    auto m = ebpf::make_unique<Module>(writer ? "snprintf" : "sscanf", *ctx_);
+    name = writer ? make_writer(&*m, type) : make_reader(&*m, type);
+    if (run_pass_manager(*m))
+      return nullptr;
+
+    if (rw_engine_) {
+      rw_engine_->addModule(move(m));
+    } else {
+      string err;
+      EngineBuilder builder(move(m));
+      builder.setErrorStr(&err);
 #if LLVM_MAJOR_VERSION <= 11
-  builder.setUseOrcMCJITReplacement(false);
+      builder.setUseOrcMCJITReplacement(false);
 #endif
-  auto engine = unique_ptr<ExecutionEngine>(builder.create());
-  if (!engine)
-    fprintf(stderr, "Could not create ExecutionEngine: %s\n", err.c_str());
-  return engine;
+      rw_engine_ = unique_ptr<ExecutionEngine>(builder.create());
+      if (!rw_engine_)
+        fprintf(stderr, "Could not create ExecutionEngine: %s\n", err.c_str());
+    }
+  }
+  if (!rw_engine_)
+    return nullptr;
+  return (void *)rw_engine_->getFunctionAddress(name);
 }
 
 int BPFModule::annotate() {
@@ -370,9 +389,6 @@ int BPFModule::annotate() {
     if (!fn->hasFnAttribute(Attribute::NoInline))
       fn->addFnAttr(Attribute::AlwaysInline);
 
-  // separate module to hold the reader functions
-  auto m = ebpf::make_unique<Module>("sscanf", *ctx_);
-
   size_t id = 0;
   Path path({id_});
   for (auto it = ts_->lower_bound(path), up = ts_->upper_bound(path); it != up; ++it) {
@@ -387,33 +403,29 @@ int BPFModule::annotate() {
         Type *key_type = st->elements()[0];
         Type *leaf_type = st->elements()[1];
 
+        // The readers and writers are only generated once called, most
+        // tables never are.
         using std::placeholders::_1;
         using std::placeholders::_2;
         using std::placeholders::_3;
-        table.key_sscanf = std::bind(&BPFModule::sscanf, this,
-                                     make_reader(&*m, key_type), _1, _2);
-        table.leaf_sscanf = std::bind(&BPFModule::sscanf, this,
-                                      make_reader(&*m, leaf_type), _1, _2);
-        table.key_snprintf = std::bind(&BPFModule::snprintf, this,
-                                       make_writer(&*m, key_type), _1, _2, _3);
+        table.key_sscanf = std::bind(&BPFModule::sscanf, this, key_type, _1, _2);
+        table.leaf_sscanf =
+            std::bind(&BPFModule::sscanf, this, leaf_type, _1, _2);
+        table.key_snprintf =
+            std::bind(&BPFModule::snprintf, this, key_type, _1, _2, _3);
         table.leaf_snprintf =
-            std::bind(&BPFModule::snprintf, this, make_writer(&*m, leaf_type),
-                      _1, _2, _3);
+            std::bind(&BPFModule::snprintf, this, leaf_type, _1, _2, _3);
       }
     }
   }
 
-  rw_engine_ = finalize_rw(move(m));
-  if (!rw_engine_)
-    return -1;
   return 0;
 }
 
-StatusTuple BPFModule::sscanf(string fn_name, const char *str, void *val) {
+StatusTuple BPFModule::sscanf(Type *type, const char *str, void *val) {
   if (!rw_engine_enabled_)
     return StatusTuple(-1, "rw_engine not enabled");
-  auto fn =
-      (int (*)(const char *, void *))rw_engine_->getFunctionAddress(fn_name);
+  auto fn = (int (*)(const char *, void *))rw_function(type, false);
   if (!fn)
     return StatusTuple(-1, "sscanf not available");
   int rc = fn(str, val);
@@ -422,12 +434,11 @@ StatusTuple BPFModule::sscanf(string fn_name, const char *str, void *val) {
   return StatusTuple(rc);
 }
 
-StatusTuple BPFModule::snprintf(string fn_name, char *str, size_t sz,
+StatusTuple BPFModule::snprintf(Type *type, char *str, size_t sz,
                                 const void *val) {
   if (!rw_engine_enabled_)
     return StatusTuple(-1, "rw_engine not enabled");
-  auto fn = (int (*)(char *, size_t,
-                     const void *))rw_engine_->getFunctionAddress(fn_name);
+  auto fn = (int (*)(char *, size_t, const void *))rw_function(type, true);
   if (!fn)
     return StatusTuple(-1, "snprintf not available");
   int rc = fn(str, sz, val);
@@ -13,6 +13,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <fcntl.h>
+#include <stdlib.h>
 #include <fstream>
 #include <sstream>
 
@@ -63,6 +65,38 @@ std::string get_pid_exe(pid_t pid) {
   return std::string(exe_path);
 }
 
+int open_private_file(const std::string &path, struct stat *st) {
+  struct stat buf;
+  if (!st)
+    st = &buf;
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (::fstat(fd, st) < 0 || !S_ISREG(st->st_mode) ||
+      st->st_uid != ::geteuid() || (st->st_mode & 022)) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool write_private_file(
+    const std::string &path,
+    const std::function<bool(int fd, const std::string &tmp)> &write,
+    mode_t mode) {
+  std::string tmp = path + ".XXXXXX";
+  int fd = ::mkostemp(&tmp[0], O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  // By path, as write() may have replaced the file.
+  bool ok = write(fd, tmp) && ::chmod(tmp.c_str(), mode) == 0 &&
+            ::rename(tmp.c_str(), path.c_str()) == 0;
+  ::close(fd);
+  if (!ok)
+    ::unlink(tmp.c_str());
+  return ok;
+}
+
 enum class field_kind_t {
     common,
     data_loc,
@@ -16,8 +16,10 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
@@ -39,6 +41,19 @@ std::vector<int> get_possible_cpus();
 
 std::string get_pid_exe(pid_t pid);
 
+// Opens path for reading if it is a regular file of this user that nobody
+// else can write to, so its contents can be trusted. Fills st if given.
+// Returns the file descriptor, or -1.
+int open_private_file(const std::string &path, struct stat *st = nullptr);
+
+// Creates path from what write() puts in a private temporary file next to it,
+// given as both a descriptor and a path, then gives the file mode and renames
+// it into place, so readers only ever see complete files.
+bool write_private_file(
+    const std::string &path,
+    const std::function<bool(int fd, const std::string &tmp)> &write,
+    mode_t mode = 0600);
+
 std::string parse_tracepoint(std::istream &input, std::string const& category,
                              std::string const& event);
 }  // namespace ebpf
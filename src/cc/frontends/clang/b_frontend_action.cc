@@ -18,6 +18,7 @@
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <mutex>
 
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
@@ -89,20 +90,29 @@ const char **get_call_conv(bool for_syscall = false) {
   return ret;
 }
 
-/* Use resolver only once per translation */
+/* Use resolver only once per translation. Programs may be compiled on
+ * several threads at once, so it is shared under a lock. */
+static std::mutex kresolver_mutex;
 static void *kresolver = NULL;
-static void *get_symbol_resolver(void) {
+static bool ksym_exists(const char *name) {
+  uint64_t addr = 0;
+
+  std::lock_guard<std::mutex> lock(kresolver_mutex);
   if (!kresolver)
     kresolver = bcc_symcache_new(-1, nullptr);
-  return kresolver;
+  return bcc_symcache_resolve_name(kresolver, nullptr, name, &addr) >= 0;
+}
+
+static void free_symbol_resolver(void) {
+  std::lock_guard<std::mutex> lock(kresolver_mutex);
+  if (kresolver) {
+    bcc_free_symcache(kresolver, -1);
+    kresolver = NULL;
+  }
 }
 
 static std::string check_bpf_probe_read_kernel(void) {
-  bool is_probe_read_kernel;
-  void *resolver = get_symbol_resolver();
-  uint64_t addr = 0;
-  is_probe_read_kernel = bcc_symcache_resolve_name(resolver, nullptr,
-                          "bpf_probe_read_kernel", &addr) >= 0 ? true: false;
+  bool is_probe_read_kernel = ksym_exists("bpf_probe_read_kernel");
 
   /* If bpf_probe_read is not found (ARCH_HAS_NON_OVERLAPPING_ADDRESS_SPACE) is
    * not set in newer kernel, then bcc would anyway fail */
@@ -117,10 +127,7 @@ static std::string check_bpf_probe_read_user(llvm::StringRef probe,
   if (probe.str() == "bpf_probe_read_user" ||
       probe.str() == "bpf_probe_read_user_str") {
     // Check for probe_user symbols in backported kernel before fallback
-    void *resolver = get_symbol_resolver();
-    uint64_t addr = 0;
-    bool found = bcc_symcache_resolve_name(resolver, nullptr,
-                  "bpf_probe_read_user", &addr) >= 0 ? true: false;
+    bool found = ksym_exists("bpf_probe_read_user");
     if (found)
       return probe.str();
 
@@ -1503,7 +1510,8 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
         error(GET_BEGINLOC(Decl), "reference to undefined table");
         return false;
       }
-      fe_.table_storage().Insert(global_path, table_it->second.dup());
+      if (fe_.table_storage().Insert(global_path, table_it->second.dup()))
+        fe_.add_shared_table(global_path);
       return true;
     } else if(section_attr == "maps/shared") {
       if (table.name.substr(0, 2) == "__")
@@ -1514,7 +1522,8 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
         error(GET_BEGINLOC(Decl), "reference to undefined table");
         return false;
       }
-      fe_.table_storage().Insert(maps_ns_path, table_it->second.dup());
+      if (fe_.table_storage().Insert(maps_ns_path, table_it->second.dup()))
+        fe_.add_shared_table(maps_ns_path);
       return true;
     }
 
@@ -1674,10 +1683,7 @@ void BFrontendAction::DoMiscWorkAround() {
   // CONFIG_CC_STACKPROTECTOR properly based on other configs, so it relieved any bpf
   // program (using task_struct, etc.) of patching the below code.
   std::string probefunc = check_bpf_probe_read_kernel();
-  if (kresolver) {
-    bcc_free_symcache(kresolver, -1);
-    kresolver = NULL;
-  }
+  free_symbol_resolver();
   if (probefunc == "bpf_probe_read") {
     probefunc = "#define bpf_probe_read_kernel bpf_probe_read\n"
       "#define bpf_probe_read_kernel_str bpf_probe_read_str\n"
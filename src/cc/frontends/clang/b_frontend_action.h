@@ -180,6 +180,10 @@ class BFrontendAction : public clang::ASTFrontendAction {
     std::tuple<int, std::string, int, int, int, int, unsigned int, std::string> map_def) {
     fake_fd_map_[fd] = move(map_def);
   }
+  // Tables inserted outside of id() by maps/export and maps/shared, for
+  // dropping them along with the tables under id().
+  const std::vector<Path> &shared_tables() const { return shared_tables_; }
+  void add_shared_table(const Path &path) { shared_tables_.push_back(path); }
 
  private:
   llvm::raw_ostream &os_;
@@ -197,6 +201,7 @@ class BFrontendAction : public clang::ASTFrontendAction {
   int next_fake_fd_;
   fake_fd_map_def &fake_fd_map_;
   std::map<std::string, std::vector<std::string>> &perf_events_;
+  std::vector<Path> shared_tables_;
 };
 
 }  // namespace visitor
@@ -13,8 +13,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <condition_variable>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unistd.h>
@@ -33,28 +35,56 @@ struct FileDeleter {
 typedef std::unique_ptr<FILE, FileDeleter> FILEPtr;
 
 // Helper with pushd/popd semantics
+// The working directory is process wide, so instances on different threads
+// share a single change of directory: an instance for the directory already
+// entered joins it, one for another directory waits until it is left.
 class DirStack {
  public:
   explicit DirStack(const std::string &dst) : ok_(false) {
-    if (getcwd(cwd_, sizeof(cwd_)) == NULL) {
-      ::perror("getcwd");
-      return;
-    }
-    if (::chdir(dst.c_str())) {
-      fprintf(stderr, "chdir(%s): %s\n", dst.c_str(), strerror(errno));
-      return;
+    std::unique_lock<std::mutex> lock(state().mutex);
+    State &s = state();
+    s.cond.wait(lock, [&] { return s.users == 0 || s.dst == dst; });
+    if (s.users == 0) {
+      if (getcwd(s.cwd, sizeof(s.cwd)) == NULL) {
+        ::perror("getcwd");
+        return;
+      }
+      if (::chdir(dst.c_str())) {
+        fprintf(stderr, "chdir(%s): %s\n", dst.c_str(), strerror(errno));
+        return;
+      }
+      s.dst = dst;
     }
+    s.users++;
+    memcpy(cwd_, s.cwd, sizeof(cwd_));
     ok_ = true;
   }
   ~DirStack() {
     if (!ok_) return;
+    std::lock_guard<std::mutex> lock(state().mutex);
+    State &s = state();
+    if (--s.users > 0)
+      return;
     if (::chdir(cwd_)) {
       fprintf(stderr, "chdir(%s): %s\n", cwd_, strerror(errno));
     }
+    s.cond.notify_all();
   }
   bool ok() const { return ok_; }
   const char * cwd() const { return cwd_; }
  private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable cond;
+    int users = 0;
+    std::string dst;
+    char cwd[256];
+  };
+  static State &state() {
+    static State s;
+    return s;
+  }
+
   bool ok_;
   char cwd_[256];
 };
@@ -17,9 +17,12 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <dirent.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <limits.h>
 #include <map>
+#include <mutex>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string>
@@ -45,19 +48,27 @@
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/FrontendDiagnostic.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/MultiplexConsumer.h>
 #include <clang/FrontendTool/Utils.h>
 #include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Rewrite/Core/Rewriter.h>
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Config/llvm-config.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/SHA1.h>
 
 #include "bcc_exception.h"
+#include "bcc_version.h"
 #include "bpf_module.h"
+#include "common.h"
 #include "exported_files.h"
 #include "kbuild_helper.h"
 #include "b_frontend_action.h"
 #include "tp_frontend_action.h"
 #include "loader.h"
 #include "arch_helper.h"
+#include "phase_stats.h"
 
 using std::map;
 using std::string;
@@ -115,6 +126,136 @@ static int CreateFromArgs(clang::CompilerInvocation &invocation,
 #endif
 }
 
+// BFrontendAction that also runs the tracepoint structure visitor, on a
+// rewriter of its own, to find out whether the source needed the separate
+// tracepoint pass before it.
+class TracepointCheckingBFrontendAction : public BFrontendAction {
+ public:
+  using BFrontendAction::BFrontendAction;
+
+  unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+      clang::CompilerInstance &Compiler, llvm::StringRef InFile) override {
+    tp_rewriter_.setSourceMgr(Compiler.getSourceManager(),
+                              Compiler.getLangOpts());
+    vector<unique_ptr<clang::ASTConsumer>> consumers;
+    consumers.push_back(unique_ptr<clang::ASTConsumer>(
+        new TracepointTypeConsumer(Compiler.getASTContext(), tp_rewriter_)));
+    consumers.push_back(BFrontendAction::CreateASTConsumer(Compiler, InFile));
+    return unique_ptr<clang::ASTConsumer>(
+        new clang::MultiplexConsumer(std::move(consumers)));
+  }
+
+  bool has_tracepoints() {
+    return tp_rewriter_.buffer_begin() != tp_rewriter_.buffer_end();
+  }
+
+ private:
+  clang::Rewriter tp_rewriter_;
+};
+
+typedef map<string, unique_ptr<llvm::MemoryBuffer>> RemappedFiles;
+
+// This option instructs clang whether or not to free the file buffers that we
+// give to it. Since the embedded header files should be copied fewer times
+// and reused if possible, set this flag to true.
+static void add_remapped_files(clang::CompilerInvocation &invocation,
+                               const RemappedFiles &headers,
+                               const RemappedFiles &footers)
+{
+  invocation.getPreprocessorOpts().RetainRemappedFileBuffers = true;
+  for (const auto &f : headers)
+    invocation.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+  for (const auto &f : footers)
+    invocation.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+}
+
+// Returns a precompiled header holding everything the -include flags in
+// ccargs pull in (bcc/bpf.h, bcc/helpers.h and the kernel headers behind
+// them), building it on first use. The header is stored in BCC_PCH_DIR,
+// keyed by the compiler arguments, the kernel headers and the bcc exported
+// headers, so it is shared by every program compiled with the same cflags.
+// Returns an empty string if BCC_PCH_DIR is unset or the header can't be
+// built. Headers are private to the user, as clang trusts their contents.
+static string get_pch(const llvm::opt::ArgStringList &ccargs,
+                      clang::DiagnosticsEngine &diags,
+                      const RemappedFiles &headers,
+                      const RemappedFiles &footers)
+{
+  using namespace clang;
+
+  const char *dir = ::getenv("BCC_PCH_DIR");
+  if (!dir || !*dir)
+    return string();
+
+  CompilerInstance compiler;
+  CompilerInvocation &invocation = compiler.getInvocation();
+  if (!CreateFromArgs(invocation, ccargs, diags))
+    return string();
+  if (invocation.getFrontendOpts().Inputs.size() != 1)
+    return string();
+
+  // The main file only contributes its name to ccargs, leave it out so that
+  // every program shares the header.
+  string input = invocation.getFrontendOpts().Inputs[0].getFile().str();
+  string key = LIBBCC_VERSION "\n" LLVM_VERSION_STRING "\n";
+  key += ClangLoader::kernel_headers_id() + "\n";
+  for (size_t i = 0; i < ccargs.size(); i++) {
+    llvm::StringRef arg(ccargs[i]);
+    if (arg == input)
+      continue;
+    if ((arg == "-main-file-name" || arg == "-o") && i + 1 < ccargs.size()) {
+      i++;
+      continue;
+    }
+    key += ccargs[i];
+    key += '\0';
+  }
+  for (auto *files : {&headers, &footers}) {
+    for (auto &f : *files) {
+      key += f.first;
+      key += '\0';
+      key += f.second->getBuffer().str();
+      key += '\0';
+    }
+  }
+  auto hash = llvm::SHA1::hash(
+      llvm::ArrayRef<uint8_t>((const uint8_t *)key.data(), key.size()));
+  string path = string(dir) + "/";
+  for (uint8_t b : hash) {
+    path += "0123456789abcdef"[b >> 4];
+    path += "0123456789abcdef"[b & 0xf];
+  }
+  path += ".pch";
+
+  // Headers anyone else could have written are rebuilt over.
+  int fd = open_private_file(path);
+  if (fd >= 0) {
+    ::close(fd);
+    return path;
+  }
+
+  // Precompile an empty main file, leaving only the -include'd headers.
+  string pch_main = "/virtual/include/bcc/pch.h";
+  unique_ptr<llvm::MemoryBuffer> pch_buf = llvm::MemoryBuffer::getMemBuffer("");
+  add_remapped_files(invocation, headers, footers);
+  invocation.getPreprocessorOpts().addRemappedFile(pch_main, &*pch_buf);
+  invocation.getFrontendOpts().Inputs.clear();
+  invocation.getFrontendOpts().Inputs.push_back(FrontendInputFile(
+      pch_main, FrontendOptions::getInputKindForExtension("c")));
+  invocation.getFrontendOpts().DisableFree = false;
+
+  compiler.createDiagnostics(new IgnoringDiagConsumer());
+
+  // Programs may compile concurrently, so clang writes to a temporary file.
+  bool ok = write_private_file(path, [&](int, const string &tmp) {
+    invocation.getFrontendOpts().OutputFile = tmp;
+    GeneratePCHAction pch_act;
+    return compiler.ExecuteAction(pch_act) &&
+           !compiler.getDiagnostics().hasErrorOccurred();
+  });
+  return ok ? path : string();
+}
+
 }
 
 int ClangLoader::parse(unique_ptr<llvm::Module> *mod, TableStorage &ts,
@@ -124,6 +265,7 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, TableStorage &ts,
                        const std::string &maps_ns,
                        fake_fd_map_def &fake_fd_map,
                        std::map<std::string, std::vector<std::string>> &perf_events) {
+  PhaseTimer timer("clang.parse", id);
   string main_path = "/virtual/main.c";
   unique_ptr<llvm::MemoryBuffer> main_buf;
   struct utsname un;
@@ -284,6 +426,88 @@ string get_clang_target(void) {
   return string(ret);
 }
 
+namespace {
+
+// Running hash of the entries nftw() visits for kernel_headers_id(), under
+// its lock.
+uint64_t headers_hash;
+
+void headers_hash_add(const void *data, size_t len) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < len; i++) {
+    headers_hash ^= p[i];
+    headers_hash *= 1099511628211ULL;
+  }
+}
+
+int headers_hash_entry(const char *path, const struct stat *st, int,
+                       struct FTW *) {
+  headers_hash_add(path, strlen(path) + 1);
+  uint64_t attrs[] = {(uint64_t)st->st_ino, (uint64_t)st->st_size,
+                      (uint64_t)st->st_mtim.tv_sec,
+                      (uint64_t)st->st_mtim.tv_nsec};
+  headers_hash_add(attrs, sizeof(attrs));
+  return 0;
+}
+
+}  // namespace
+
+string ClangLoader::kernel_headers_id() {
+  struct utsname un;
+  uname(&un);
+  string id = string(un.release) + "\n" + un.version + "\n" + un.machine + "\n";
+
+  // parse() takes the kernel headers from the current directory.
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)))
+    id += string(cwd) + "\n";
+  // Headers may be edited or replaced in place, which leaves the mtime of
+  // their directories alone. So take every entry below the include
+  // directories into account, a few thousand stat() calls. That is done once
+  // per process and set of include directories, as identified by their
+  // device, inode and mtime: headers edited in place under a running process
+  // are seen by the next one.
+  vector<string> dirs;
+  if (DIR *arch = ::opendir("arch")) {
+    while (struct dirent *e = ::readdir(arch))
+      if (e->d_name[0] != '.')
+        dirs.push_back(string("arch/") + e->d_name + "/include");
+    ::closedir(arch);
+  }
+  std::sort(dirs.begin(), dirs.end());
+  dirs.insert(dirs.begin(), "include");
+  string dirs_id = id;
+  for (auto &dir : dirs) {
+    struct stat st;
+    if (::stat(dir.c_str(), &st) == 0)
+      dirs_id += dir + " " + std::to_string(st.st_dev) + " " +
+                 std::to_string(st.st_ino) + " " +
+                 std::to_string(st.st_mtim.tv_sec) + "." +
+                 std::to_string(st.st_mtim.tv_nsec) + "\n";
+  }
+
+  static std::mutex headers_mutex;
+  static string headers_dirs_id, headers_id;
+  {
+    std::lock_guard<std::mutex> lock(headers_mutex);
+    if (dirs_id != headers_dirs_id) {
+      headers_hash = 14695981039346656037ULL;
+      for (auto &dir : dirs)
+        ::nftw(dir.c_str(), headers_hash_entry, 16, FTW_PHYS);
+      char hash[17];
+      snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)headers_hash);
+      headers_dirs_id = dirs_id;
+      headers_id = string(hash) + "\n";
+    }
+    id += headers_id;
+  }
+
+  const char *version_override = ::getenv("BCC_LINUX_VERSION_CODE");
+  if (version_override)
+    id += version_override;
+  return id;
+}
+
 int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
                             bool in_memory,
                             const vector<const char *> &flags_cstr_in,
@@ -355,77 +579,131 @@ int ClangLoader::do_compile(unique_ptr<llvm::Module> *mod, TableStorage &ts,
     llvm::errs() << "\n";
   }
 
-  // pre-compilation pass for generating tracepoint structures
-  CompilerInstance compiler0;
-  CompilerInvocation &invocation0 = compiler0.getInvocation();
-  if (!CreateFromArgs(invocation0, ccargs, diags))
-    return -1;
+  string pch;
+  {
+    PhaseTimer timer("clang.pch", id);
+    pch = get_pch(ccargs, diags, remapped_headers_, remapped_footers_);
+  }
 
-  invocation0.getPreprocessorOpts().RetainRemappedFileBuffers = true;
-  for (const auto &f : remapped_headers_)
-    invocation0.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
-  for (const auto &f : remapped_footers_)
-    invocation0.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+  // Most programs take no tracepoint structures as arguments, so first try
+  // the rewrite straight on the main file, checking for tracepoint arguments
+  // on the side. If any show up, or anything gets diagnosed, the results are
+  // dropped and the separate passes below run instead, reporting diagnostics.
+  // Debug output would be printed twice on fallback, so skip it there.
+  string out_str1;
+  bool rewritten = false;
+  if (in_memory && !(flags_ & DEBUG_PREPROCESSOR)) {
+    PhaseTimer timer("clang.rewrite", id);
+    CompilerInstance compiler1;
+    CompilerInvocation &invocation1 = compiler1.getInvocation();
+    if (!CreateFromArgs(invocation1, ccargs, diags))
+      return -1;
 
-  if (in_memory) {
-    invocation0.getPreprocessorOpts().addRemappedFile(main_path, &*main_buf);
-    invocation0.getFrontendOpts().Inputs.clear();
-    invocation0.getFrontendOpts().Inputs.push_back(FrontendInputFile(
+    add_remapped_files(invocation1, remapped_headers_, remapped_footers_);
+    invocation1.getPreprocessorOpts().ImplicitPCHInclude = pch;
+    invocation1.getPreprocessorOpts().addRemappedFile(main_path, &*main_buf);
+    invocation1.getFrontendOpts().Inputs.clear();
+    invocation1.getFrontendOpts().Inputs.push_back(FrontendInputFile(
         main_path, FrontendOptions::getInputKindForExtension("c")));
+    invocation1.getFrontendOpts().DisableFree = false;
+
+    compiler1.createDiagnostics(new IgnoringDiagConsumer());
+
+    llvm::raw_string_ostream os1(out_str1);
+    TracepointCheckingBFrontendAction bact(os1, flags_, ts, id, main_path,
+                                           func_src, mod_src, maps_ns,
+                                           fake_fd_map, perf_events);
+    rewritten = compiler1.ExecuteAction(bact) && !bact.has_tracepoints() &&
+                !compiler1.getDiagnostics().hasErrorOccurred() &&
+                compiler1.getDiagnostics().getNumWarnings() == 0;
+    os1.flush();
+    if (!rewritten) {
+      ts.DeletePrefix(Path({id}));
+      for (const Path &path : bact.shared_tables())
+        ts.Delete(path);
+      func_src.clear();
+      mod_src.clear();
+      fake_fd_map.clear();
+      perf_events.clear();
+      out_str1.clear();
+    }
   }
-  invocation0.getFrontendOpts().DisableFree = false;
-
-  compiler0.createDiagnostics(new IgnoringDiagConsumer());
 
-  // capture the rewritten c file
-  string out_str;
-  llvm::raw_string_ostream os(out_str);
-  TracepointFrontendAction tpact(os);
-  compiler0.ExecuteAction(tpact); // ignore errors, they will be reported later
-  unique_ptr<llvm::MemoryBuffer> out_buf = llvm::MemoryBuffer::getMemBuffer(out_str);
-
-  // first pass
-  CompilerInstance compiler1;
-  CompilerInvocation &invocation1 = compiler1.getInvocation();
-  if (!CreateFromArgs( invocation1, ccargs, diags))
-    return -1;
+  if (!rewritten) {
+    // pre-compilation pass for generating tracepoint structures
+    string out_str;
+    unique_ptr<PhaseTimer> timer(new PhaseTimer("clang.pass0", id));
+    for (;;) {
+      CompilerInstance compiler0;
+      CompilerInvocation &invocation0 = compiler0.getInvocation();
+      if (!CreateFromArgs(invocation0, ccargs, diags))
+        return -1;
+
+      add_remapped_files(invocation0, remapped_headers_, remapped_footers_);
+      invocation0.getPreprocessorOpts().ImplicitPCHInclude = pch;
+
+      if (in_memory) {
+        invocation0.getPreprocessorOpts().addRemappedFile(main_path, &*main_buf);
+        invocation0.getFrontendOpts().Inputs.clear();
+        invocation0.getFrontendOpts().Inputs.push_back(FrontendInputFile(
+            main_path, FrontendOptions::getInputKindForExtension("c")));
+      }
+      invocation0.getFrontendOpts().DisableFree = false;
+
+      compiler0.createDiagnostics(new IgnoringDiagConsumer());
+
+      // capture the rewritten c file
+      llvm::raw_string_ostream os(out_str);
+      TracepointFrontendAction tpact(os);
+      compiler0.ExecuteAction(tpact); // ignore errors, they will be reported later
+      os.flush();
+
+      // The main file is only written out if the source file could be opened.
+      // Nothing comes back when clang rejects a stale precompiled header, e.g.
+      // after the kernel headers changed underneath it, so drop it and retry.
+      if (!out_str.empty() || pch.empty())
+        break;
+      ::unlink(pch.c_str());
+      pch.clear();
+    }
+    unique_ptr<llvm::MemoryBuffer> out_buf = llvm::MemoryBuffer::getMemBuffer(out_str);
+
+    // first pass
+    timer.reset();
+    timer.reset(new PhaseTimer("clang.pass1", id));
+    CompilerInstance compiler1;
+    CompilerInvocation &invocation1 = compiler1.getInvocation();
+    if (!CreateFromArgs( invocation1, ccargs, diags))
+      return -1;
 
-  // This option instructs clang whether or not to free the file buffers that we
-  // give to it. Since the embedded header files should be copied fewer times
-  // and reused if possible, set this flag to true.
-  invocation1.getPreprocessorOpts().RetainRemappedFileBuffers = true;
-  for (const auto &f : remapped_headers_)
-    invocation1.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
-  for (const auto &f : remapped_footers_)
-    invocation1.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
-  invocation1.getPreprocessorOpts().addRemappedFile(main_path, &*out_buf);
-  invocation1.getFrontendOpts().Inputs.clear();
-  invocation1.getFrontendOpts().Inputs.push_back(FrontendInputFile(
-      main_path, FrontendOptions::getInputKindForExtension("c")));
-  invocation1.getFrontendOpts().DisableFree = false;
+    add_remapped_files(invocation1, remapped_headers_, remapped_footers_);
+    invocation1.getPreprocessorOpts().ImplicitPCHInclude = pch;
+    invocation1.getPreprocessorOpts().addRemappedFile(main_path, &*out_buf);
+    invocation1.getFrontendOpts().Inputs.clear();
+    invocation1.getFrontendOpts().Inputs.push_back(FrontendInputFile(
+        main_path, FrontendOptions::getInputKindForExtension("c")));
+    invocation1.getFrontendOpts().DisableFree = false;
 
-  compiler1.createDiagnostics();
+    compiler1.createDiagnostics();
 
-  // capture the rewritten c file
-  string out_str1;
-  llvm::raw_string_ostream os1(out_str1);
-  BFrontendAction bact(os1, flags_, ts, id, main_path, func_src, mod_src,
-                       maps_ns, fake_fd_map, perf_events);
-  if (!compiler1.ExecuteAction(bact))
-    return -1;
+    // capture the rewritten c file
+    llvm::raw_string_ostream os1(out_str1);
+    BFrontendAction bact(os1, flags_, ts, id, main_path, func_src, mod_src,
+                         maps_ns, fake_fd_map, perf_events);
+    if (!compiler1.ExecuteAction(bact))
+      return -1;
+  }
   unique_ptr<llvm::MemoryBuffer> out_buf1 = llvm::MemoryBuffer::getMemBuffer(out_str1);
 
   // second pass, clear input and take rewrite buffer
+  PhaseTimer timer("clang.pass2", id);
   CompilerInstance compiler2;
   CompilerInvocation &invocation2 = compiler2.getInvocation();
   if (!CreateFromArgs(invocation2, ccargs, diags))
     return -1;
 
-  invocation2.getPreprocessorOpts().RetainRemappedFileBuffers = true;
-  for (const auto &f : remapped_headers_)
-    invocation2.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
-  for (const auto &f : remapped_footers_)
-    invocation2.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+  add_remapped_files(invocation2, remapped_headers_, remapped_footers_);
+  invocation2.getPreprocessorOpts().ImplicitPCHInclude = pch;
   invocation2.getPreprocessorOpts().addRemappedFile(main_path, &*out_buf1);
   invocation2.getFrontendOpts().Inputs.clear();
   invocation2.getFrontendOpts().Inputs.push_back(FrontendInputFile(
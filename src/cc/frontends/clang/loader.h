@@ -45,6 +45,7 @@ class FuncSource {
   const char * src_rewritten(const std::string& name);
   void set_src(const std::string& name, const std::string& src);
   void set_src_rewritten(const std::string& name, const std::string& src);
+  const std::map<std::string, SourceCode> &funcs() const { return funcs_; }
 };
 
 class ClangLoader {
@@ -57,6 +58,8 @@ class ClangLoader {
             std::string &mod_src, const std::string &maps_ns,
             fake_fd_map_def &fake_fd_map,
             std::map<std::string, std::vector<std::string>> &perf_events);
+  // Identifies the kernel headers and machine parse() compiles against.
+  static std::string kernel_headers_id();
 
  private:
   int do_compile(std::unique_ptr<llvm::Module> *mod, TableStorage &ts,
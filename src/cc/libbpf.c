@@ -34,6 +34,7 @@
 #include <linux/version.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -363,6 +364,23 @@ int bpf_lookup_and_delete_batch(int fd, __u32 *in_batch, __u32 *out_batch, void
                                          count, NULL);
 }
 
+int bpf_lookup_batch(int fd, __u32 *in_batch, __u32 *out_batch, void *keys,
+                     void *values, __u32 *count)
+{
+  return bpf_map_lookup_batch(fd, in_batch, out_batch, keys, values, count,
+                              NULL);
+}
+
+int bpf_update_batch(int fd, void *keys, void *values, __u32 *count)
+{
+  return bpf_map_update_batch(fd, keys, values, count, NULL);
+}
+
+int bpf_delete_batch(int fd, void *keys, __u32 *count)
+{
+  return bpf_map_delete_batch(fd, keys, count, NULL);
+}
+
 int bpf_get_first_key(int fd, void *key, size_t key_size)
 {
   int i, res;
@@ -562,12 +580,88 @@ int bpf_prog_get_tag(int fd, unsigned long long *ptag)
   return 0;
 }
 
+// Verifier log buffer reused by the program loads on each thread, freed
+// after loads that grew it past LOG_BUF_SIZE, or through log_arena_key when
+// the thread exits.
+static __thread char *log_arena;
+static __thread unsigned log_arena_size;
+static pthread_key_t log_arena_key;
+static pthread_once_t log_arena_once = PTHREAD_ONCE_INIT;
+// Size of the largest verifier log seen so far, used to size the log of
+// loads that ask for one up front.
+static unsigned log_size_hint = LOG_BUF_SIZE;
+
+// Returns the largest verifier log to ask for. BCC_LOG_BUF_MAX overrides the
+// default, within what the kernel accepts.
+static unsigned log_buf_max(void)
+{
+  const char *env = getenv("BCC_LOG_BUF_MAX");
+  unsigned long max = env ? strtoul(env, NULL, 0) : 0;
+
+  if (max == 0)
+    return LOG_BUF_MAX;
+  if (max < LOG_BUF_SIZE)
+    return LOG_BUF_SIZE;
+  if (max > UINT_MAX >> 2)
+    return UINT_MAX >> 2;
+  return max;
+}
+
+static void log_arena_key_create(void)
+{
+  pthread_key_create(&log_arena_key, free);
+}
+
+// Returns this thread's log arena, grown to at least size bytes.
+static char *log_arena_get(unsigned size)
+{
+  if (log_arena_size < size) {
+    pthread_once(&log_arena_once, log_arena_key_create);
+    free(log_arena);
+    log_arena_size = 0;
+    log_arena = malloc(size);
+    pthread_setspecific(log_arena_key, log_arena);
+    if (!log_arena) {
+      fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
+              strerror(errno));
+      return NULL;
+    }
+    log_arena_size = size;
+  }
+  log_arena[0] = 0;
+  return log_arena;
+}
+
+// Frees this thread's log arena if a large log grew it, so that only arenas
+// of the steady-state size stay around between loads.
+static void log_arena_trim(void)
+{
+  if (log_arena_size <= LOG_BUF_SIZE)
+    return;
+  free(log_arena);
+  log_arena = NULL;
+  log_arena_size = 0;
+  pthread_setspecific(log_arena_key, NULL);
+}
+
+static void log_size_update(const char *log, unsigned size)
+{
+  unsigned used = strnlen(log, size) + 1;
+  unsigned hint = __atomic_load_n(&log_size_hint, __ATOMIC_RELAXED);
+
+  while (used > hint &&
+         !__atomic_compare_exchange_n(&log_size_hint, &hint, used, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
 int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
                         char *log_buf, unsigned log_buf_size, bool allow_rlimit)
 {
   unsigned name_len = attr->name ? strlen(attr->name) : 0;
   char *tmp_log_buf = NULL, *attr_log_buf = NULL;
   unsigned tmp_log_buf_size = 0, attr_log_buf_size = 0;
+  unsigned max_log_size = log_buf_max();
   int ret = 0, name_offset = 0, expected_attach_type = 0;
   char prog_name[BPF_OBJ_NAME_LEN] = {};
 
@@ -581,15 +675,15 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
       attr_log_buf = log_buf;
       attr_log_buf_size = log_buf_size;
     } else {
-      // Create and use temporary log buffer if user didn't provide one.
-      tmp_log_buf_size = LOG_BUF_SIZE;
-      tmp_log_buf = malloc(tmp_log_buf_size);
+      // Use the thread's log arena if user didn't provide one, sized for
+      // the largest log seen so far.
+      tmp_log_buf_size = __atomic_load_n(&log_size_hint, __ATOMIC_RELAXED);
+      if (tmp_log_buf_size > max_log_size)
+        tmp_log_buf_size = max_log_size;
+      tmp_log_buf = log_arena_get(tmp_log_buf_size);
       if (!tmp_log_buf) {
-        fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
-                strerror(errno));
         attr->log_level = 0;
       } else {
-        tmp_log_buf[0] = 0;
         attr_log_buf = tmp_log_buf;
         attr_log_buf_size = tmp_log_buf_size;
       }
@@ -628,11 +722,11 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
                                        expected_attach_type);
       if (ret == -EINVAL) {
         fprintf(stderr, "bpf: vmlinux BTF is not found\n");
-        return ret;
+        goto return_result;
       } else if (ret < 0) {
         fprintf(stderr, "bpf: %s is not found in vmlinux BTF\n",
                 attr->name + name_offset);
-        return ret;
+        goto return_result;
       }
 
       attr->attach_btf_id = ret;
@@ -667,7 +761,7 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
 
   if (ret < 0 && errno == EPERM) {
     if (!allow_rlimit)
-      return ret;
+      goto return_result;
 
     // When EPERM is returned, two reasons are possible:
     //  1. user has no permissions for bpf()
@@ -689,7 +783,8 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
     fprintf(stderr,
             "bpf: %s. Program %s too large (%u insns), at most %d insns\n\n",
             strerror(errno), attr->name, insns_cnt, BPF_MAXINSNS);
-    return -1;
+    ret = -1;
+    goto return_result;
   }
 
   // The load has failed. Handle log message.
@@ -708,30 +803,20 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
       goto return_result;
     }
 
-    // User did not provide log buffer. We will try to increase size of
-    // our temporary log buffer to get full error message.
-    if (tmp_log_buf)
-      free(tmp_log_buf);
-    tmp_log_buf_size = LOG_BUF_SIZE;
-    if (attr->log_level == 0)
-      attr->log_level = 1;
-    for (;;) {
-      tmp_log_buf = malloc(tmp_log_buf_size);
-      if (!tmp_log_buf) {
-        fprintf(stderr, "bpf: Failed to allocate temporary log buffer: %s\n\n",
-                strerror(errno));
+    // User did not provide log buffer. Unless the load already produced a
+    // complete log, verify once more into a buffer of the maximum size, so
+    // a failed load never runs the verifier more than twice.
+    if (!tmp_log_buf || errno == ENOSPC) {
+      if (attr->log_level == 0)
+        attr->log_level = 1;
+      tmp_log_buf_size = max_log_size;
+      tmp_log_buf = log_arena_get(tmp_log_buf_size);
+      if (!tmp_log_buf)
         goto return_result;
-      }
-      tmp_log_buf[0] = 0;
       ret = bpf_load_program_xattr(attr, tmp_log_buf, tmp_log_buf_size);
-      if (ret < 0 && errno == ENOSPC) {
-        // Temporary buffer size is not enough. Double it and try again.
-        free(tmp_log_buf);
-        tmp_log_buf = NULL;
-        tmp_log_buf_size <<= 1;
-      } else {
-        break;
-      }
+      if (ret < 0 && errno == ENOSPC)
+        fprintf(stderr, "bpf: log truncated at %u bytes, see BCC_LOG_BUF_MAX\n",
+                tmp_log_buf_size);
     }
   }
 
@@ -745,10 +830,11 @@ int bcc_prog_load_xattr(struct bpf_load_program_attr *attr, int prog_len,
     else if (tmp_log_buf)
       bpf_print_hints(ret, tmp_log_buf);
   }
+  if (tmp_log_buf)
+    log_size_update(tmp_log_buf, tmp_log_buf_size);
 
 return_result:
-  if (tmp_log_buf)
-    free(tmp_log_buf);
+  log_arena_trim();
   return ret;
 }
 
@@ -1270,6 +1356,19 @@ int bpf_attach_lsm(int prog_fd)
 void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
                             perf_reader_lost_cb lost_cb, void *cb_cookie,
                             int pid, int cpu, int page_cnt) {
+  struct bcc_perf_buffer_opts opts = {
+    .pid = pid,
+    .cpu = cpu,
+    .wakeup_events = 1,
+  };
+
+  return bpf_open_perf_buffer_opts(raw_cb, lost_cb, cb_cookie, page_cnt, &opts);
+}
+
+void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int page_cnt,
+                                 struct bcc_perf_buffer_opts *opts) {
   int pfd;
   struct perf_event_attr attr = {};
   struct perf_reader *reader = NULL;
@@ -1282,8 +1381,14 @@ void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
   attr.type = PERF_TYPE_SOFTWARE;
   attr.sample_type = PERF_SAMPLE_RAW;
   attr.sample_period = 1;
-  attr.wakeup_events = 1;
-  pfd = syscall(__NR_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+  if (opts->wakeup_watermark > 0) {
+    attr.watermark = 1;
+    attr.wakeup_watermark = opts->wakeup_watermark;
+  } else {
+    attr.wakeup_events = opts->wakeup_events > 1 ? opts->wakeup_events : 1;
+  }
+  pfd = syscall(__NR_perf_event_open, &attr, opts->pid, opts->cpu, -1,
+                PERF_FLAG_FD_CLOEXEC);
   if (pfd < 0) {
     fprintf(stderr, "perf_event_open: %s\n", strerror(errno));
     fprintf(stderr, "   (check your kernel for PERF_COUNT_SW_BPF_OUTPUT support, 4.4 or newer)\n");
@@ -46,6 +46,20 @@ int bpf_get_first_key(int fd, void *key, size_t key_size);
 int bpf_get_next_key(int fd, void *key, void *next_key);
 int bpf_lookup_and_delete(int fd, void *key, void *value);
 
+/*
+ * Batched map operations (BPF_MAP_*_BATCH, kernel 5.6+). On entry *count is
+ * the number of slots in keys/values; on return it holds the number of
+ * elements processed. in_batch/out_batch carry the iteration cursor between
+ * calls, pass a NULL in_batch to start from the beginning of the map.
+ * Return -1 with errno ENOENT once the end of the map has been reached.
+ */
+int bpf_lookup_batch(int fd, __u32 *in_batch, __u32 *out_batch, void *keys,
+                     void *values, __u32 *count);
+int bpf_lookup_and_delete_batch(int fd, __u32 *in_batch, __u32 *out_batch,
+                                void *keys, void *values, __u32 *count);
+int bpf_update_batch(int fd, void *keys, void *values, __u32 *count);
+int bpf_delete_batch(int fd, void *keys, __u32 *count);
+
 /*
  * Load a BPF program, and return the FD of the loaded program.
  *
@@ -79,6 +93,16 @@ int bpf_open_raw_sock(const char *name);
 typedef void (*perf_reader_raw_cb)(void *cb_cookie, void *raw, int raw_size);
 typedef void (*perf_reader_lost_cb)(void *cb_cookie, uint64_t lost);
 
+/* A raw sample as seen by perf_reader_batch_cb. data points straight into
+ * the perf ring buffer and is only valid until the callback returns. */
+struct perf_reader_raw_sample {
+  void *data;
+  int size;
+};
+typedef void (*perf_reader_batch_cb)(void *cb_cookie,
+                                     struct perf_reader_raw_sample *samples,
+                                     int cnt);
+
 int bpf_attach_kprobe(int progfd, enum bpf_probe_attach_type attach_type,
                       const char *ev_name, const char *fn_name, uint64_t fn_offset,
                       int maxactive);
@@ -105,6 +129,21 @@ void * bpf_open_perf_buffer(perf_reader_raw_cb raw_cb,
                             perf_reader_lost_cb lost_cb, void *cb_cookie,
                             int pid, int cpu, int page_cnt);
 
+struct bcc_perf_buffer_opts {
+  int pid;
+  int cpu;
+  /* Wake up the poller every wakeup_events samples (values < 1 mean 1). */
+  int wakeup_events;
+  /* If > 0, wake up once this many bytes are pending instead; takes
+   * precedence over wakeup_events. */
+  int wakeup_watermark;
+};
+
+void * bpf_open_perf_buffer_opts(perf_reader_raw_cb raw_cb,
+                                 perf_reader_lost_cb lost_cb, void *cb_cookie,
+                                 int page_cnt,
+                                 struct bcc_perf_buffer_opts *opts);
+
 /* attached a prog expressed by progfd to the device specified in dev_name */
 int bpf_attach_xdp(const char *dev_name, int progfd, uint32_t flags);
 
@@ -149,6 +188,8 @@ int bcc_iter_attach(int prog_fd, union bpf_iter_link_info *link_info,
 int bcc_iter_create(int link_fd);
 
 #define LOG_BUF_SIZE 65536
+// Default limit on the verifier log bcc allocates, see BCC_LOG_BUF_MAX.
+#define LOG_BUF_MAX (16 * 1024 * 1024)
 
 // Put non-static/inline functions in their own section with this prefix +
 // fn_name to enable discovery by the bcc library.
@@ -37,12 +37,18 @@ enum {
   RB_USED_IN_READ = 2, // used in read
 };
 
+// perf_event_header.size is a u16, no record can be larger than this
+#define PERF_RECORD_MAX_SIZE 65536
+
 struct perf_reader {
   perf_reader_raw_cb raw_cb;
   perf_reader_lost_cb lost_cb;
+  perf_reader_batch_cb batch_cb;
   void *cb_cookie; // to be returned in the cb
   void *buf; // for keeping segmented data
   size_t buf_size;
+  struct perf_reader_raw_sample *samples; // pending batch for batch_cb
+  struct perf_reader_stats stats;
   void *base;
   int rb_use_state;
   pid_t rb_read_tid;
@@ -81,6 +87,7 @@ void perf_reader_free(void *ptr) {
       close(reader->fd);
     }
     free(reader->buf);
+    free(reader->samples);
     free(ptr);
   }
 }
@@ -114,7 +121,29 @@ struct perf_sample_trace_kprobe {
   uint64_t ip;
 };
 
-static void parse_sw(struct perf_reader *reader, void *data, int size) {
+int perf_reader_set_batch_cb(struct perf_reader *reader,
+                             perf_reader_batch_cb batch_cb) {
+  void *buf = reader->buf;
+
+  // Allocate everything the batched read path needs up front, so that
+  // consuming the ring never touches the allocator.
+  if (reader->buf_size < PERF_RECORD_MAX_SIZE) {
+    buf = realloc(reader->buf, PERF_RECORD_MAX_SIZE);
+    if (!buf)
+      return -1;
+    reader->buf = buf;
+    reader->buf_size = PERF_RECORD_MAX_SIZE;
+  }
+  if (!reader->samples) {
+    reader->samples = calloc(PERF_READER_BATCH_SIZE, sizeof(*reader->samples));
+    if (!reader->samples)
+      return -1;
+  }
+  reader->batch_cb = batch_cb;
+  return 0;
+}
+
+static int parse_sample(void *data, int size, void **raw_data, int *raw_size) {
   uint8_t *ptr = data;
   struct perf_event_header *header = (void *)data;
 
@@ -126,24 +155,62 @@ static void parse_sw(struct perf_reader *reader, void *data, int size) {
   ptr += sizeof(*header);
   if (ptr > (uint8_t *)data + size) {
     fprintf(stderr, "%s: corrupt sample header\n", __FUNCTION__);
-    return;
+    return -1;
   }
 
   raw = (void *)ptr;
   ptr += sizeof(raw->size) + raw->size;
   if (ptr > (uint8_t *)data + size) {
     fprintf(stderr, "%s: corrupt raw sample\n", __FUNCTION__);
-    return;
+    return -1;
   }
 
   // sanity check
   if (ptr != (uint8_t *)data + size) {
     fprintf(stderr, "%s: extra data at end of sample\n", __FUNCTION__);
-    return;
+    return -1;
   }
 
+  *raw_data = raw->data;
+  *raw_size = raw->size;
+  return 0;
+}
+
+// Counters are only written by the thread holding RB_USED_IN_READ, plain
+// relaxed stores are enough and keep the read path free of locked ops.
+static void stats_add(uint64_t *counter, uint64_t val) {
+  __atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
+static void parse_sw(struct perf_reader *reader, void *data, int size) {
+  void *raw_data;
+  int raw_size;
+
+  if (parse_sample(data, size, &raw_data, &raw_size) < 0)
+    return;
+  stats_add(&reader->stats.samples, 1);
+  stats_add(&reader->stats.bytes, raw_size);
   if (reader->raw_cb)
-    reader->raw_cb(reader->cb_cookie, raw->data, raw->size);
+    reader->raw_cb(reader->cb_cookie, raw_data, raw_size);
+}
+
+static void handle_lost(struct perf_reader *reader, uint8_t *ptr) {
+  /*
+   * struct {
+   *    struct perf_event_header    header;
+   *    u64                id;
+   *    u64                lost;
+   *    struct sample_id        sample_id;
+   * };
+   */
+  uint64_t lost = *(uint64_t *)(ptr + sizeof(struct perf_event_header) +
+                                sizeof(uint64_t));
+  stats_add(&reader->stats.lost, lost);
+  if (reader->lost_cb) {
+    reader->lost_cb(reader->cb_cookie, lost);
+  } else {
+    fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
+  }
 }
 
 static uint64_t read_data_head(volatile struct perf_event_mmap_page *perf_header) {
@@ -157,18 +224,96 @@ static void write_data_tail(volatile struct perf_event_mmap_page *perf_header, u
   perf_header->data_tail = data_tail;
 }
 
+// Return a contiguous view of the record starting at begin. Records that
+// wrap around the end of the ring are copied into reader->buf, which only
+// grows, everything else is handed out in place.
+static uint8_t *record_ptr(struct perf_reader *reader, uint8_t *begin,
+                           uint8_t *base, uint8_t *sentinel, size_t size) {
+  size_t len = sentinel - begin;
+
+  if (size <= len)
+    return begin;
+  if (reader->buf_size < size) {
+    void *buf = realloc(reader->buf, size);
+    if (!buf)
+      return NULL;
+    reader->buf = buf;
+    reader->buf_size = size;
+  }
+  memcpy(reader->buf, begin, len);
+  memcpy((uint8_t *)reader->buf + len, base, size - len);
+  return reader->buf;
+}
+
+static void flush_batch(struct perf_reader *reader, int *cnt) {
+  if (*cnt > 0)
+    reader->batch_cb(reader->cb_cookie, reader->samples, *cnt);
+  *cnt = 0;
+}
+
+// Batched variant of perf_reader_event_read(): collect the raw samples
+// between data_tail and data_head without copying them out of the ring, hand
+// them to batch_cb in one call and publish the new data_tail once. Within one
+// pass at most one record can straddle the end of the ring, so the single
+// preallocated reader->buf is enough to linearize it.
+static void perf_reader_event_read_batch(struct perf_reader *reader) {
+  volatile struct perf_event_mmap_page *perf_header = reader->base;
+  uint64_t buffer_size = (uint64_t)reader->page_size * reader->page_cnt;
+  uint8_t *base = (uint8_t *)reader->base + reader->page_size;
+  uint8_t *sentinel = base + buffer_size;
+  uint64_t data_head, data_tail = perf_header->data_tail;
+
+  for (data_head = read_data_head(perf_header); data_tail != data_head;
+       data_head = read_data_head(perf_header)) {
+    int cnt = 0;
+
+    while (data_tail != data_head && cnt < PERF_READER_BATCH_SIZE) {
+      uint8_t *begin = base + data_tail % buffer_size;
+      // event header is u64, won't wrap
+      struct perf_event_header *e = (void *)begin;
+      uint8_t *ptr = record_ptr(reader, begin, base, sentinel, e->size);
+
+      if (!ptr) {
+        fprintf(stderr, "%s: unable to allocate record buffer\n", __FUNCTION__);
+      } else if (e->type == PERF_RECORD_LOST) {
+        // keep the loss notification ordered with respect to the samples
+        flush_batch(reader, &cnt);
+        handle_lost(reader, ptr);
+      } else if (e->type == PERF_RECORD_SAMPLE) {
+        struct perf_reader_raw_sample *sample = &reader->samples[cnt];
+        if (parse_sample(ptr, e->size, &sample->data, &sample->size) == 0) {
+          stats_add(&reader->stats.samples, 1);
+          stats_add(&reader->stats.bytes, sample->size);
+          cnt++;
+        }
+      } else {
+        fprintf(stderr, "%s: unknown sample type %d\n", __FUNCTION__, e->type);
+      }
+      data_tail += e->size;
+    }
+
+    flush_batch(reader, &cnt);
+    write_data_tail(perf_header, data_tail);
+  }
+}
+
 void perf_reader_event_read(struct perf_reader *reader) {
   volatile struct perf_event_mmap_page *perf_header = reader->base;
   uint64_t buffer_size = (uint64_t)reader->page_size * reader->page_cnt;
   uint64_t data_head;
   uint8_t *base = (uint8_t *)reader->base + reader->page_size;
   uint8_t *sentinel = (uint8_t *)reader->base + buffer_size + reader->page_size;
-  uint8_t *begin, *end;
+  uint8_t *begin;
 
   reader->rb_read_tid = syscall(__NR_gettid);
   if (!__sync_bool_compare_and_swap(&reader->rb_use_state, RB_NOT_USED, RB_USED_IN_READ))
     return;
 
+  if (reader->batch_cb) {
+    perf_reader_event_read_batch(reader);
+    goto done;
+  }
+
   // Consume all the events on this ring, calling the cb function for each one.
   // The message may fall on the ring boundary, in which case copy the message
   // into a malloced buffer.
@@ -180,32 +325,12 @@ void perf_reader_event_read(struct perf_reader *reader) {
     begin = base + data_tail % buffer_size;
     // event header is u64, won't wrap
     struct perf_event_header *e = (void *)begin;
-    ptr = begin;
-    end = base + (data_tail + e->size) % buffer_size;
-    if (end < begin) {
-      // perf event wraps around the ring, make a contiguous copy
-      reader->buf = realloc(reader->buf, e->size);
-      size_t len = sentinel - begin;
-      memcpy(reader->buf, begin, len);
-      memcpy((void *)((unsigned long)reader->buf + len), base, e->size - len);
-      ptr = reader->buf;
-    }
+    ptr = record_ptr(reader, begin, base, sentinel, e->size);
 
-    if (e->type == PERF_RECORD_LOST) {
-      /*
-       * struct {
-       *    struct perf_event_header    header;
-       *    u64                id;
-       *    u64                lost;
-       *    struct sample_id        sample_id;
-       * };
-       */
-      uint64_t lost = *(uint64_t *)(ptr + sizeof(*e) + sizeof(uint64_t));
-      if (reader->lost_cb) {
-        reader->lost_cb(reader->cb_cookie, lost);
-      } else {
-        fprintf(stderr, "Possibly lost %" PRIu64 " samples\n", lost);
-      }
+    if (!ptr) {
+      fprintf(stderr, "%s: unable to allocate record buffer\n", __FUNCTION__);
+    } else if (e->type == PERF_RECORD_LOST) {
+      handle_lost(reader, ptr);
     } else if (e->type == PERF_RECORD_SAMPLE) {
       parse_sw(reader, ptr, e->size);
     } else {
@@ -214,6 +339,8 @@ void perf_reader_event_read(struct perf_reader *reader) {
 
     write_data_tail(perf_header, perf_header->data_tail + e->size);
   }
+
+done:
   reader->rb_use_state = RB_NOT_USED;
   __sync_synchronize();
   reader->rb_read_tid = 0;
@@ -244,3 +371,10 @@ void perf_reader_set_fd(struct perf_reader *reader, int fd) {
 int perf_reader_fd(struct perf_reader *reader) {
   return reader->fd;
 }
+
+void perf_reader_get_stats(struct perf_reader *reader,
+                           struct perf_reader_stats *stats) {
+  stats->samples = __atomic_load_n(&reader->stats.samples, __ATOMIC_RELAXED);
+  stats->bytes = __atomic_load_n(&reader->stats.bytes, __ATOMIC_RELAXED);
+  stats->lost = __atomic_load_n(&reader->stats.lost, __ATOMIC_RELAXED);
+}
@@ -23,16 +23,33 @@
 extern "C" {
 #endif
 
+#define PERF_READER_BATCH_SIZE 256
+
 struct perf_reader;
 
+/* Cumulative counters of a perf_reader, safe to read from any thread. */
+struct perf_reader_stats {
+  uint64_t samples; /* raw samples delivered to the callback */
+  uint64_t bytes;   /* raw sample payload bytes delivered */
+  uint64_t lost;    /* samples the kernel reported as lost */
+};
+
 struct perf_reader * perf_reader_new(perf_reader_raw_cb raw_cb,
                                      perf_reader_lost_cb lost_cb,
                                      void *cb_cookie, int page_cnt);
 void perf_reader_free(void *ptr);
 int perf_reader_mmap(struct perf_reader *reader);
+/* Switch the reader to batch mode: instead of one raw_cb call per sample,
+ * every read hands up to PERF_READER_BATCH_SIZE samples to batch_cb at once,
+ * pointing directly into the ring, and data_tail is advanced once per batch.
+ * Must be called before the first read. Returns 0 on success. */
+int perf_reader_set_batch_cb(struct perf_reader *reader,
+                             perf_reader_batch_cb batch_cb);
 void perf_reader_event_read(struct perf_reader *reader);
 int perf_reader_poll(int num_readers, struct perf_reader **readers, int timeout);
 int perf_reader_fd(struct perf_reader *reader);
+void perf_reader_get_stats(struct perf_reader *reader,
+                           struct perf_reader_stats *stats);
 void perf_reader_set_fd(struct perf_reader *reader, int fd);
 
 #ifdef __cplusplus
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "phase_stats.h"
+
+namespace ebpf {
+
+namespace {
+
+struct PhaseSinks {
+  PhaseSinks() : json(nullptr) {
+    const char *path = getenv("BCC_PHASE_STATS");
+    if (path && *path)
+      json = fopen(path, "ae");
+    listening = json != nullptr;
+  }
+
+  std::mutex mutex;
+  std::shared_ptr<PhaseCallback> callback;
+  FILE *json;
+  std::atomic<bool> listening;
+};
+
+PhaseSinks &sinks() {
+  // Never destroyed, phases may end while the process exits.
+  static PhaseSinks *s = new PhaseSinks();
+  return *s;
+}
+
+thread_local int phase_depth = 0;
+
+uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int64_t rss_bytes() {
+  int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  char buf[128];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  long long size, resident;
+  if (sscanf(buf, "%lld %lld", &size, &resident) != 2)
+    return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+void write_json(FILE *f, const PhaseStats &s) {
+  fprintf(f, "{\"phase\":\"%s\",\"name\":\"", s.phase);
+  for (unsigned char c : s.name) {
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fprintf(f,
+          "\",\"depth\":%d,\"wall_ns\":%llu,\"cpu_ns\":%llu,"
+          "\"rss_delta\":%lld,\"insn_cnt\":%llu,\"verified_insns\":%llu}\n",
+          s.depth, (unsigned long long)s.wall_ns, (unsigned long long)s.cpu_ns,
+          (long long)s.rss_delta, (unsigned long long)s.insn_cnt,
+          (unsigned long long)s.verified_insns);
+  fflush(f);
+}
+
+}  // namespace
+
+void set_phase_callback(PhaseCallback cb) {
+  PhaseSinks &s = sinks();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (cb)
+    s.callback = std::make_shared<PhaseCallback>(std::move(cb));
+  else
+    s.callback.reset();
+  s.listening = s.callback || s.json;
+}
+
+PhaseTimer::PhaseTimer(const char *phase, const std::string &name)
+    : active_(sinks().listening), stats_() {
+  if (!active_)
+    return;
+  stats_.phase = phase;
+  stats_.name = name;
+  stats_.depth = phase_depth++;
+  rss_start_ = rss_bytes();
+  cpu_start_ = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  wall_start_ = clock_ns(CLOCK_MONOTONIC);
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!active_)
+    return;
+  stats_.wall_ns = clock_ns(CLOCK_MONOTONIC) - wall_start_;
+  stats_.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start_;
+  stats_.rss_delta = rss_bytes() - rss_start_;
+  phase_depth--;
+
+  PhaseSinks &s = sinks();
+  std::shared_ptr<PhaseCallback> cb;
+  {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    cb = s.callback;
+    if (s.json)
+      write_json(s.json, stats_);
+  }
+  if (cb)
+    (*cb)(stats_);
+}
+
+}  // namespace ebpf
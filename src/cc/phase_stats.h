@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+namespace ebpf {
+
+/// Cost of one phase of loading a program: compiling, creating maps, loading
+/// a function into the kernel, attaching it. Phases nest, e.g. the clang
+/// passes run within "clang.parse", and are reported innermost first.
+struct PhaseStats {
+  const char *phase;
+  // Module id, function or probe name the phase worked on, if any.
+  std::string name;
+  // Nesting level on the reporting thread, 0 for outermost phases.
+  int depth;
+  uint64_t wall_ns;
+  // CPU time of the reporting thread.
+  uint64_t cpu_ns;
+  // Change in resident memory of the whole process, which includes other
+  // threads loading programs at the same time.
+  int64_t rss_delta;
+  // For "prog_load": instructions submitted, and instructions processed by
+  // the verifier if the kernel reports it (5.16+), or 0.
+  uint64_t insn_cnt;
+  uint64_t verified_insns;
+};
+
+typedef std::function<void(const PhaseStats &)> PhaseCallback;
+
+/// Sets the process-wide callback to report phases to, or clears it if cb is
+/// empty. Callbacks may run concurrently on different threads. Independently
+/// of the callback, setting BCC_PHASE_STATS to a file name appends every
+/// phase to that file as a line of JSON.
+void set_phase_callback(PhaseCallback cb);
+
+/// Measures the scope it lives in as a phase, if anything listens.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(const char *phase, const std::string &name = "");
+  ~PhaseTimer();
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+  bool active() const { return active_; }
+  PhaseStats &stats() { return stats_; }
+
+ private:
+  bool active_;
+  PhaseStats stats_;
+  uint64_t wall_start_;
+  uint64_t cpu_start_;
+  int64_t rss_start_;
+};
+
+}  // namespace ebpf
@@ -27,7 +27,8 @@ namespace ebpf {
 using std::string;
 using std::unique_ptr;
 
-/// A process-wide singleton of shared tables
+/// A process-wide singleton of shared tables, or tables of one module when
+/// constructed with private set
 class SharedTableStorage : public TableStorageImpl {
  public:
   class iterator : public TableStorageIteratorImpl {
@@ -44,6 +45,9 @@ class SharedTableStorage : public TableStorageImpl {
     virtual value_type &operator*() const override { return *it_; }
     virtual pointer operator->() const override { return &*it_; }
   };
+  explicit SharedTableStorage(bool priv = false)
+      : own_(priv ? new std::map<string, TableDesc> : nullptr),
+        tables_(priv ? *own_ : shared_tables_) {}
   virtual ~SharedTableStorage() {}
   virtual bool Find(const string &name, TableStorage::iterator &result) const override;
   virtual bool Insert(const string &name, TableDesc &&desc) override;
@@ -55,7 +59,9 @@ class SharedTableStorage : public TableStorageImpl {
   virtual unique_ptr<TableStorageIteratorImpl> erase(const TableStorageIteratorImpl &it) override;
 
  private:
-  static std::map<string, TableDesc> tables_;
+  static std::map<string, TableDesc> shared_tables_;
+  unique_ptr<std::map<string, TableDesc>> own_;
+  std::map<string, TableDesc> &tables_;
 };
 
 bool SharedTableStorage::Find(const string &name, TableStorage::iterator &result) const {
@@ -103,7 +109,7 @@ unique_ptr<TableStorageIteratorImpl> SharedTableStorage::erase(const TableStorag
 }
 
 // All maps for this process are kept in global static storage.
-std::map<string, TableDesc> SharedTableStorage::tables_;
+std::map<string, TableDesc> SharedTableStorage::shared_tables_;
 
 unique_ptr<TableStorage> createSharedTableStorage() {
   auto t = make_unique<TableStorage>();
@@ -111,4 +117,11 @@ unique_ptr<TableStorage> createSharedTableStorage() {
   t->AddMapTypesVisitor(createJsonMapTypesVisitor());
   return t;
 }
+
+unique_ptr<TableStorage> createPrivateTableStorage() {
+  auto t = make_unique<TableStorage>();
+  t->Init(make_unique<SharedTableStorage>(true));
+  t->AddMapTypesVisitor(createJsonMapTypesVisitor());
+  return t;
+}
 }
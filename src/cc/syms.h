@@ -16,7 +16,10 @@
 #pragma once
 
 #include <algorithm>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sys/types.h>
 #include <unordered_map>
@@ -49,26 +52,110 @@ public:
 };
 
 class KSyms : SymbolCache {
-  struct Symbol {
-    Symbol(const char *name, const char *mod, uint64_t addr) : name(name), mod(mod), addr(addr) {}
-    std::string name;
-    std::string mod;
-    uint64_t addr;
-
-    bool operator<(const Symbol &rhs) const { return addr < rhs.addr; }
-  };
-
-  std::vector<Symbol> syms_;
-  std::unordered_map<std::string, uint64_t> symnames_;
+public:
+  // Sources of the loaded kernel modules, by name and load address, and of
+  // the symbols in kallsyms format.
+  typedef std::function<std::map<std::string, uint64_t>()> ModulesSource;
+  typedef std::function<void(bcc_procutils_ksymcb, void *)> SymbolsSource;
+
+private:
+  // Symbols sorted by address, one array per field. Symbol and module names
+  // are NUL-terminated strings in names_, each module name stored once.
+  std::vector<uint64_t> addrs_;
+  std::vector<uint32_t> name_offs_;
+  std::vector<uint32_t> mod_offs_;
+  std::string names_;
+  // Offsets of module names in names_, and bytes of names_ no longer used
+  // by any symbol since their module was unloaded.
+  std::unordered_map<std::string, uint32_t> mod_names_;
+  size_t dead_names_ = 0;
+  // Whether resolve_addr() returned pointers into names_, and the arenas
+  // such pointers may still point into, kept until the next refresh().
+  bool names_in_use_ = false;
+  std::vector<std::string> retired_names_;
+  // Symbol indexes sorted by name, built on the first resolve_name().
+  std::vector<uint32_t> by_name_;
+  // Kernel modules and their load addresses when symbols were last read, and
+  // when to look at them again.
+  std::map<std::string, uint64_t> modules_;
+  uint64_t next_modules_check_ = 0;
+  ModulesSource modules_src_;
+  SymbolsSource symbols_src_;
+  // Whether the sources are /proc/modules and /proc/kallsyms, the only ones
+  // kept as a snapshot.
+  bool from_kernel_;
+
+  struct Loader;
   static void _add_symbol(const char *, const char *, uint64_t, void *);
+  void load();
+  void update_modules();
+  void remove_module(const std::string &name);
+  void retire_names(bool keep_contents);
+  void compact_names();
+  bool load_snapshot(const std::string &file, uint64_t modules_id);
+  void save_snapshot(const std::string &file, uint64_t modules_id) const;
 
 public:
+  // Reads the running kernel's modules and symbols, unless other sources are
+  // given.
+  explicit KSyms(ModulesSource modules = nullptr,
+                 SymbolsSource symbols = nullptr);
+
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) override;
   virtual bool resolve_name(const char *unused, const char *name,
                             uint64_t *addr) override;
+  // Loads the symbols on first use, and later splices in the symbols of
+  // kernel modules loaded or unloaded since. Resolving looks for module
+  // changes on its own, at most once a second.
+  // The names resolve_addr() returns stay valid until the next refresh().
   virtual void refresh() override;
 };
 
+// SymbolIndex is a read-only, memory-mapped copy of an ELF's sorted symbol
+// table, persisted under the directory named by BCC_SYM_INDEX_DIR. Indexes
+// are keyed by the ELF build-id (or device/inode/mtime/size when the file has
+// none) plus the symbol options, so processes mapping the same binary share
+// one file and one set of page-cache pages instead of each parsing the ELF.
+// Indexes are written private to the user, and ones that aren't are ignored.
+class SymbolIndex {
+public:
+  struct Entry {
+    uint64_t start;
+    uint64_t size;
+    uint64_t name_off;
+  };
+
+  ~SymbolIndex();
+
+  // Return the index for the ELF at path, building and persisting it first if
+  // needed. Returns nullptr when indexing is disabled or fails, in which case
+  // the caller should fall back to reading the ELF directly.
+  static std::shared_ptr<SymbolIndex> load(const std::string &path,
+                                           const bcc_symbol_option *option);
+
+  size_t size() const { return nsyms_; }
+  const char *name(const Entry &e) const {
+    return e.name_off < strtab_size_ ? strtab_ + e.name_off : "";
+  }
+  // Last symbol starting at or below offset, ignoring symbol sizes.
+  const Entry *floor(uint64_t offset) const;
+  // Symbol containing offset, taking nested symbols into account.
+  const Entry *find(uint64_t offset) const;
+
+private:
+  SymbolIndex(void *base, size_t len);
+  static std::shared_ptr<SymbolIndex> open(const std::string &file);
+  static bool build(const std::string &path, const bcc_symbol_option *option,
+                    const std::string &file);
+
+  void *base_;
+  size_t len_;
+  const Entry *syms_;
+  size_t nsyms_;
+  const char *strtab_;
+  size_t strtab_size_;
+};
+
 class ProcSyms : SymbolCache {
   struct NameIdx {
     size_t section_idx;
@@ -111,6 +198,19 @@ class ProcSyms : SymbolCache {
     VDSO
   };
 
+  // Symbols of a single module. Tables of ELF files are shared through a
+  // process-wide store by all ProcSyms instances mapping the same file, so
+  // symbol memory grows with distinct binaries rather than with processes.
+  struct SymbolTable {
+    // Guards loading and lazy name resolution of shared tables.
+    std::mutex mutex_;
+    bool loaded_ = false;
+    std::unordered_set<std::string> symnames_;
+    std::vector<Symbol> syms_;
+    // When set, symbols are looked up here and syms_ stays empty.
+    std::shared_ptr<SymbolIndex> index_;
+  };
+
   struct Module {
     struct Range {
       uint64_t start;
@@ -124,8 +224,10 @@ class ProcSyms : SymbolCache {
 
     std::string name_;
     std::string path_;
+    // Inode of the mapped file, used to tell whether a module survived a
+    // refresh.
+    uint64_t inode_;
     std::vector<Range> ranges_;
-    bool loaded_;
     bcc_symbol_option *symbol_option_;
     ModuleType type_;
 
@@ -133,12 +235,13 @@ class ProcSyms : SymbolCache {
     uint64_t elf_so_offset_;
     uint64_t elf_so_addr_;
 
-    std::unordered_set<std::string> symnames_;
-    std::vector<Symbol> syms_;
+    std::shared_ptr<SymbolTable> table_;
 
     void load_sym_table();
+    std::shared_ptr<SymbolTable> shared_table() const;
 
     bool contains(uint64_t addr, uint64_t &offset) const;
+    uint64_t offset_of(const Range &range, uint64_t addr) const;
     uint64_t start() const { return ranges_.begin()->start; }
 
     bool find_addr(uint64_t offset, struct bcc_symbol *sym);
@@ -151,8 +254,26 @@ class ProcSyms : SymbolCache {
                                 int debugfile, void *p);
   };
 
+  // Entry of the sorted index over the ranges of all modules except perf
+  // maps, which cover the whole address space and are searched separately.
+  struct RangeIdx {
+    uint64_t start;
+    uint64_t end;
+    // Largest end of this and all preceding entries, which bounds the
+    // backwards scan over overlapping ranges.
+    uint64_t max_end;
+    size_t module;
+    size_t range;
+  };
+
   int pid_;
   std::vector<Module> modules_;
+  // Modules of the previous load, only populated during refresh().
+  std::unordered_map<std::string, Module> stale_modules_;
+  std::vector<RangeIdx> range_idx_;
+  std::vector<size_t> perf_maps_;
+  // range_idx_ entry of the last unambiguous lookup, tried before searching.
+  size_t last_hit_;
   ProcStat procstat_;
   bcc_symbol_option symbol_option_;
 
@@ -161,6 +282,10 @@ class ProcSyms : SymbolCache {
   static int _add_module(mod_info *, int, void *);
   void load_exe();
   void load_modules();
+  bool reuse_module(const std::string &name, const std::string &path,
+                    uint64_t inode);
+  void build_range_idx();
+  Module *find_module(uint64_t addr, uint64_t &offset);
 
 public:
   ProcSyms(int pid, struct bcc_symbol_option *option = nullptr);
@@ -168,6 +293,9 @@ public:
   virtual bool resolve_addr(uint64_t addr, struct bcc_symbol *sym, bool demangle = true) override;
   virtual bool resolve_name(const char *module, const char *name,
                             uint64_t *addr) override;
+  // Symbol table of the module mapped at addr, or null if there is none or
+  // its symbols were not read yet. Tells reused modules from reloaded ones.
+  const SymbolTable *module_table(uint64_t addr);
 };
 
 class BuildSyms {
@@ -192,6 +320,7 @@ class BuildSyms {
     bool loaded_;
     std::unordered_set<std::string> symnames_;
     std::vector<Symbol> syms_;
+    std::shared_ptr<SymbolIndex> index_;
     bcc_symbol_option symbol_option_;
 
     bool load_sym_table();
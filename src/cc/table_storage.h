@@ -109,5 +109,8 @@ class TableStorage {
 };
 
 std::unique_ptr<TableStorage> createSharedTableStorage();
+// Same as createSharedTableStorage(), but not shared with other modules, so
+// safe to use alongside other modules on other threads.
+std::unique_ptr<TableStorage> createPrivateTableStorage();
 std::unique_ptr<TableStorage> createBpfFsTableStorage();
 }
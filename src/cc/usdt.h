@@ -40,6 +40,10 @@ class ArgumentParser;
 static const std::string USDT_PROGRAM_HEADER =
     "#include <uapi/linux/ptrace.h>\n";
 
+// Probes with at least this many locations can look up the argument layout of
+// the location that fired in a BPF table, see Probe::usdt_getarg().
+static const size_t USDT_LOCATION_TABLE_MIN = 16;
+
 static const std::string COMPILER_BARRIER =
     "__asm__ __volatile__(\"\": : :\"memory\");";
 
@@ -212,6 +216,11 @@ class Probe {
   optional<uint64_t> attached_semaphore_;
   uint8_t mod_match_inode_only_;
 
+  // BPF hash emitted by the last usdt_getarg() with a location table, and the
+  // entries to fill it with: global address of each location => layout group.
+  std::string location_table_name_;
+  std::vector<std::pair<uint64_t, uint32_t>> location_table_;
+
   std::string largest_arg_type(size_t arg_n);
 
   bool add_to_semaphore(int16_t val);
@@ -234,8 +243,18 @@ public:
   const char *location_bin_path(size_t n = 0) const { return locations_[n].bin_path_.c_str(); }
   const Location &location(size_t n) const { return locations_[n]; }
 
+  // Emits the functions reading each argument. Locations that read all
+  // arguments the same way share code. With location_table set, a probe
+  // with USDT_LOCATION_TABLE_MIN or more locations finds the layout of the
+  // location that fired in a BPF hash keyed by IP instead of comparing the
+  // IP against every location; the caller must fill that table through
+  // fill_location_table() once the program is loaded.
   bool usdt_getarg(std::ostream &stream);
-  bool usdt_getarg(std::ostream &stream, const std::string& probe_func);
+  bool usdt_getarg(std::ostream &stream, const std::string& probe_func,
+                   bool location_table = false);
+  bool has_location_table() const { return !location_table_name_.empty(); }
+  const std::string &location_table_name() const { return location_table_name_; }
+  bool fill_location_table(int fd) const;
   std::string get_arg_ctype(int arg_index) {
     return largest_arg_type(arg_index);
   }
@@ -259,6 +278,9 @@ public:
 
 class Context {
   std::vector<std::unique_ptr<Probe>> probes_;
+  // Index of probes_ by probe name, in the order found. A name is rarely
+  // used by more than one provider.
+  std::unordered_map<std::string, std::vector<Probe *>> probes_by_name_;
   std::unordered_set<std::string> modules_;
 
   optional<int> pid_;
@@ -274,6 +296,8 @@ class Context {
   std::string resolve_bin_path(const std::string &bin_path);
   Probe *get_checked(const std::string &provider_name,
                      const std::string &probe_name);
+  std::unique_ptr<Probe> release(const std::string &provider_name,
+                                 const std::string &probe_name);
 
 private:
   uint8_t mod_match_inode_only_;
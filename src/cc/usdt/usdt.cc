@@ -15,7 +15,11 @@
  */
 #include <algorithm>
 #include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <tuple>
 #include <unordered_set>
 
 #include <fcntl.h>
@@ -26,6 +30,7 @@
 #include "bcc_elf.h"
 #include "bcc_proc.h"
 #include "common.h"
+#include "libbpf.h"
 #include "usdt.h"
 #include "vendor/tinyformat.hpp"
 #include "bcc_usdt.h"
@@ -169,44 +174,112 @@ bool Probe::usdt_getarg(std::ostream &stream) {
   return usdt_getarg(stream, attached_to_.value());
 }
 
-bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
+bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func,
+                        bool location_table) {
   const size_t arg_count = locations_[0].arguments_.size();
 
+  location_table_name_.clear();
+  location_table_.clear();
   if (arg_count == 0)
     return true;
 
+  std::vector<std::string> ctypes, cptrs;
   for (size_t arg_n = 0; arg_n < arg_count; ++arg_n) {
-    std::string ctype = largest_arg_type(arg_n);
-    std::string cptr = tfm::format("*((%s *)dest)", ctype);
+    ctypes.push_back(largest_arg_type(arg_n));
+    cptrs.push_back(tfm::format("*((%s *)dest)", ctypes.back()));
+  }
+
+  // Group locations by the code reading their arguments. Inlined copies of a
+  // probe mostly find their arguments in the same registers or stack slots,
+  // so there are far fewer groups than locations.
+  std::vector<std::vector<std::string>> layouts;
+  std::map<std::vector<std::string>, uint32_t> layout_ids;
+  std::vector<uint32_t> groups;
+  for (Location &location : locations_) {
+    std::vector<std::string> layout;
+    for (size_t arg_n = 0; arg_n < arg_count; ++arg_n) {
+      std::ostringstream code;
+      if (!location.arguments_[arg_n].assign_to_local(code, cptrs[arg_n],
+                                                      location.bin_path_, pid_))
+        return false;
+      layout.push_back(code.str());
+    }
+    auto it = layout_ids.emplace(layout, layouts.size()).first;
+    if (it->second == layouts.size())
+      layouts.push_back(std::move(layout));
+    groups.push_back(it->second);
+  }
+
+  std::vector<uint64_t> addresses;
+  if (layouts.size() > 1) {
+    for (Location &location : locations_) {
+      uint64_t global_address;
 
+      if (!resolve_global_address(&global_address, location.bin_path_,
+                                  location.address_))
+        return false;
+      addresses.push_back(global_address);
+    }
+  }
+
+  if (location_table && layouts.size() > 1 &&
+      locations_.size() >= USDT_LOCATION_TABLE_MIN) {
+    location_table_name_ = "__usdt_loc_" + probe_func;
+    for (size_t i = 0; i < locations_.size(); ++i)
+      location_table_.emplace_back(addresses[i], groups[i]);
+    tfm::format(stream, "BPF_HASH(%s, u64, u32, %d);\n", location_table_name_,
+                locations_.size());
+    // Every argument read needs the group. Remember the last location seen
+    // on this CPU with its group, so an event looks up the table at most once.
+    tfm::format(stream,
+                "struct __usdt_grp_%s_t { u64 ip; u32 group; };\n"
+                "BPF_PERCPU_ARRAY(__usdt_grp_%s, struct __usdt_grp_%s_t, 1);\n"
+                "static __always_inline int _bpf_usdt_group_%s("
+                "struct pt_regs *ctx) {\n"
+                "  u64 __ip = PT_REGS_IP(ctx);\n"
+                "  int __zero = 0;\n"
+                "  struct __usdt_grp_%s_t *__last = "
+                "__usdt_grp_%s.lookup(&__zero);\n"
+                "  if (!__last) return -1;\n"
+                "  if (__last->ip != __ip) {\n"
+                "    u32 *__group = %s.lookup(&__ip);\n"
+                "    if (!__group) return -1;\n"
+                "    __last->ip = __ip;\n"
+                "    __last->group = *__group;\n"
+                "  }\n"
+                "  return __last->group;\n"
+                "}\n",
+                probe_func, probe_func, probe_func, probe_func, probe_func,
+                probe_func, location_table_name_);
+  }
+
+  for (size_t arg_n = 0; arg_n < arg_count; ++arg_n) {
     tfm::format(stream,
                 "static __always_inline int _bpf_readarg_%s_%d("
                 "struct pt_regs *ctx, void *dest, size_t len) {\n"
                 "  if (len != sizeof(%s)) return -1;\n",
-                probe_func, arg_n + 1, ctype);
-
-    if (locations_.size() == 1) {
-      Location &location = locations_.front();
-      stream << "  ";
-      if (!location.arguments_[arg_n].assign_to_local(stream, cptr, location.bin_path_,
-                                                      pid_))
-        return false;
-      stream << "\n  return 0;\n}\n";
+                probe_func, arg_n + 1, ctypes[arg_n]);
+
+    if (layouts.size() == 1) {
+      stream << "  " << layouts[0][arg_n] << "\n  return 0;\n}\n";
+    } else if (has_location_table()) {
+      tfm::format(stream, "  switch(_bpf_usdt_group_%s(ctx)) {\n",
+                  probe_func);
+      for (size_t g = 0; g < layouts.size(); ++g)
+        tfm::format(stream, "  case %d: %s return 0;\n", g, layouts[g][arg_n]);
+      stream << "  }\n";
+      stream << "  return -1;\n}\n";
     } else {
       stream << "  switch(PT_REGS_IP(ctx)) {\n";
-      for (Location &location : locations_) {
-        uint64_t global_address;
-
-        if (!resolve_global_address(&global_address, location.bin_path_,
-                                    location.address_))
-          return false;
-
-        tfm::format(stream, "  case 0x%xULL: ", global_address);
-        if (!location.arguments_[arg_n].assign_to_local(stream, cptr, location.bin_path_,
-                                                        pid_))
-          return false;
-
-        stream << " return 0;\n";
+      for (size_t g = 0; g < layouts.size(); ++g) {
+        const char *sep = "";
+        for (size_t i = 0; i < locations_.size(); ++i) {
+          if (groups[i] != g)
+            continue;
+          tfm::format(stream, "%s  case 0x%xULL:", sep, addresses[i]);
+          sep = "\n";
+        }
+        stream << " " << layouts[g][arg_n] << " return 0;\n";
       }
       stream << "  }\n";
       stream << "  return -1;\n}\n";
@@ -215,6 +288,14 @@ bool Probe::usdt_getarg(std::ostream &stream, const std::string& probe_func) {
   return true;
 }
 
+bool Probe::fill_location_table(int fd) const {
+  for (auto entry : location_table_) {
+    if (bpf_update_elem(fd, &entry.first, &entry.second, 0) != 0)
+      return false;
+  }
+  return true;
+}
+
 void Probe::add_location(uint64_t addr, const std::string &bin_path, const char *fmt) {
   locations_.emplace_back(addr, bin_path, fmt);
 }
@@ -222,7 +303,8 @@ void Probe::add_location(uint64_t addr, const std::string &bin_path, const char
 void Probe::finalize_locations() {
   std::sort(locations_.begin(), locations_.end(),
             [](const Location &a, const Location &b) {
-              return a.bin_path_ < b.bin_path_ || a.address_ < b.address_;
+              int cmp = a.bin_path_.compare(b.bin_path_);
+              return cmp < 0 || (cmp == 0 && a.address_ < b.address_);
             });
   auto last = std::unique(locations_.begin(), locations_.end(),
                           [](const Location &a, const Location &b) {
@@ -231,6 +313,91 @@ void Probe::finalize_locations() {
   locations_.erase(last, locations_.end());
 }
 
+namespace {
+
+// Probe notes of one binary, as bcc_elf_foreach_usdt() reported them.
+struct ProbeNote {
+  uint64_t pc;
+  uint64_t base_addr;
+  uint64_t semaphore;
+  uint64_t semaphore_offset;
+  std::string provider;
+  std::string name;
+  std::string arg_fmt;
+};
+
+struct ProbeNotes {
+  int res;
+  std::vector<ProbeNote> notes;
+};
+
+// Binaries are identified by device, inode, mtime and size, so that the same
+// file seen from many processes, directly or through /proc/PID/root, is only
+// parsed once. Replaced binaries get a new identity.
+typedef std::tuple<dev_t, ino_t, int64_t, int64_t, off_t> BinaryId;
+
+const size_t kProbeNotesCacheSize = 256;
+
+std::mutex probe_notes_mutex;
+std::map<BinaryId, std::shared_ptr<const ProbeNotes>> probe_notes_cache;
+std::deque<BinaryId> probe_notes_order;
+
+// bcc_elf_foreach_usdt(), consulting and filling the cache of parsed notes.
+int foreach_usdt_cached(const char *path, bcc_elf_probecb callback,
+                        void *payload) {
+  struct stat st;
+  if (::stat(path, &st) < 0)
+    return bcc_elf_foreach_usdt(path, callback, payload);
+  BinaryId id(st.st_dev, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+              st.st_size);
+
+  std::shared_ptr<const ProbeNotes> notes;
+  {
+    std::lock_guard<std::mutex> lock(probe_notes_mutex);
+    auto it = probe_notes_cache.find(id);
+    if (it != probe_notes_cache.end())
+      notes = it->second;
+  }
+
+  if (!notes) {
+    auto parsed = std::make_shared<ProbeNotes>();
+    parsed->res = bcc_elf_foreach_usdt(
+        path,
+        [](const char *, const struct bcc_elf_usdt *probe, void *p) {
+          static_cast<ProbeNotes *>(p)->notes.push_back(
+              {probe->pc, probe->base_addr, probe->semaphore,
+               probe->semaphore_offset, probe->provider, probe->name,
+               probe->arg_fmt});
+        },
+        parsed.get());
+    notes = parsed;
+
+    std::lock_guard<std::mutex> lock(probe_notes_mutex);
+    if (probe_notes_cache.emplace(id, notes).second) {
+      probe_notes_order.push_back(id);
+      if (probe_notes_order.size() > kProbeNotesCacheSize) {
+        probe_notes_cache.erase(probe_notes_order.front());
+        probe_notes_order.pop_front();
+      }
+    }
+  }
+
+  for (const ProbeNote &note : notes->notes) {
+    struct bcc_elf_usdt probe;
+    probe.pc = note.pc;
+    probe.base_addr = note.base_addr;
+    probe.semaphore = note.semaphore;
+    probe.semaphore_offset = note.semaphore_offset;
+    probe.provider = note.provider.c_str();
+    probe.name = note.name.c_str();
+    probe.arg_fmt = note.arg_fmt.c_str();
+    callback(path, &probe, payload);
+  }
+  return notes->res;
+}
+
+}  // namespace
+
 void Context::_each_probe(const char *binpath, const struct bcc_elf_usdt *probe,
                           void *p) {
   Context *ctx = static_cast<Context *>(p);
@@ -249,14 +416,15 @@ int Context::_each_module(mod_info *mod, int enter_ns, void *p) {
   // executable region. We are going to parse the ELF on disk anyway, so we
   // don't need these duplicates.
   if (ctx->modules_.insert(path).second /*inserted new?*/) {
-    bcc_elf_foreach_usdt(path.c_str(), _each_probe, p);
+    foreach_usdt_cached(path.c_str(), _each_probe, p);
   }
   return 0;
 }
 
 void Context::add_probe(const char *binpath, const struct bcc_elf_usdt *probe) {
-  for (auto &p : probes_) {
-    if (p->provider_ == probe->provider && p->name_ == probe->name) {
+  std::vector<Probe *> &named = probes_by_name_[probe->name];
+  for (Probe *p : named) {
+    if (p->provider_ == probe->provider) {
       p->add_location(probe->pc, binpath, probe->arg_fmt);
       return;
     }
@@ -266,6 +434,7 @@ void Context::add_probe(const char *binpath, const struct bcc_elf_usdt *probe) {
     new Probe(binpath, probe->provider, probe->name, probe->semaphore,
               probe->semaphore_offset, pid_, mod_match_inode_only_)
   );
+  named.push_back(probes_.back().get());
   probes_.back()->add_location(probe->pc, binpath, probe->arg_fmt);
 }
 
@@ -288,22 +457,40 @@ std::string Context::resolve_bin_path(const std::string &bin_path) {
 }
 
 Probe *Context::get(const std::string &probe_name) {
-  for (auto &p : probes_) {
-    if (p->name_ == probe_name)
-      return p.get();
-  }
-  return nullptr;
+  auto it = probes_by_name_.find(probe_name);
+  if (it == probes_by_name_.end() || it->second.empty())
+    return nullptr;
+  return it->second.front();
 }
 
 Probe *Context::get(const std::string &provider_name,
                     const std::string &probe_name) {
-  for (auto &p : probes_) {
-    if (p->provider_ == provider_name && p->name_ == probe_name)
-      return p.get();
+  auto it = probes_by_name_.find(probe_name);
+  if (it == probes_by_name_.end())
+    return nullptr;
+  for (Probe *p : it->second) {
+    if (p->provider_ == provider_name)
+      return p;
   }
   return nullptr;
 }
 
+std::unique_ptr<Probe> Context::release(const std::string &provider_name,
+                                        const std::string &probe_name) {
+  Probe *probe = get(provider_name, probe_name);
+  if (!probe)
+    return nullptr;
+
+  std::vector<Probe *> &named = probes_by_name_[probe_name];
+  named.erase(std::find(named.begin(), named.end(), probe));
+  auto it = std::find_if(
+      probes_.begin(), probes_.end(),
+      [probe](const std::unique_ptr<Probe> &p) { return p.get() == probe; });
+  std::unique_ptr<Probe> res = std::move(*it);
+  probes_.erase(it);
+  return res;
+}
+
 bool Context::enable_probe(const std::string &probe_name,
                            const std::string &fn_name) {
   return enable_probe("", probe_name, fn_name);
@@ -314,20 +501,18 @@ Probe *Context::get_checked(const std::string &provider_name,
   if (pid_stat_ && pid_stat_->is_stale())
     return nullptr;
 
-  Probe *found_probe = nullptr;
-  for (auto &p : probes_) {
-    if (p->name_ == probe_name &&
-        (provider_name.empty() || p->provider() == provider_name)) {
-      if (found_probe != nullptr) {
-        fprintf(stderr, "Two same-name probes (%s) but different providers\n",
-                probe_name.c_str());
-        return nullptr;
-      }
-      found_probe = p.get();
-    }
-  }
+  if (!provider_name.empty())
+    return get(provider_name, probe_name);
 
-  return found_probe;
+  auto it = probes_by_name_.find(probe_name);
+  if (it == probes_by_name_.end() || it->second.empty())
+    return nullptr;
+  if (it->second.size() > 1) {
+    fprintf(stderr, "Two same-name probes (%s) but different providers\n",
+            probe_name.c_str());
+    return nullptr;
+  }
+  return it->second.front();
 }
 
 bool Context::enable_probe(const std::string &provider_name,
@@ -387,7 +572,7 @@ Context::Context(const std::string &bin_path, uint8_t mod_match_inode_only)
     : loaded_(false), mod_match_inode_only_(mod_match_inode_only) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
-    if (bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this) == 0) {
+    if (foreach_usdt_cached(full_path.c_str(), _each_probe, this) == 0) {
       cmd_bin_path_ = full_path;
       loaded_ = true;
     }
@@ -416,7 +601,7 @@ Context::Context(int pid, const std::string &bin_path,
       mod_match_inode_only_(mod_match_inode_only) {
   std::string full_path = resolve_bin_path(bin_path);
   if (!full_path.empty()) {
-    int res = bcc_elf_foreach_usdt(full_path.c_str(), _each_probe, this);
+    int res = foreach_usdt_cached(full_path.c_str(), _each_probe, this);
     if (res == 0) {
       cmd_bin_path_ = ebpf::get_pid_exe(pid);
       if (cmd_bin_path_.empty())
@@ -93,6 +93,20 @@ TEST_CASE("test array table", "[array_table]") {
     std::vector<int> offlinetable = t.get_table_offline();
     REQUIRE(localtable == offlinetable);
   }
+
+  SECTION("batch operations") {
+    std::vector<int> localtable(128);
+    for (int i = 0; i < 128; i++)
+      localtable[i] = i * 7;
+
+    res = t.update_batch(localtable, 32);
+    REQUIRE(res.code() == 0);
+
+    std::vector<int> batchtable;
+    res = t.get_table_batch(batchtable, 32);
+    REQUIRE(res.code() == 0);
+    REQUIRE(localtable == batchtable);
+  }
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
@@ -219,6 +219,16 @@ TEST_CASE("test bpf stack table", "[bpf_stack_table]") {
     }
   REQUIRE(found);
 
+  auto batch = stack_traces.get_stack_symbols(
+      {{stack_id, -1}, {-1, -1}, {stack_id, -1}});
+  REQUIRE(batch.frames.size() == 3);
+  REQUIRE(batch.frames[0].size() == symbols.size());
+  REQUIRE(batch.frames[1].empty());
+  REQUIRE(batch.frames[2] == batch.frames[0]);
+  REQUIRE(batch.symbols.size() <= symbols.size());
+  for (size_t i = 0; i < symbols.size(); i++)
+    REQUIRE(batch.symbols[batch.frames[0][i]] == symbols[i]);
+
   stack_traces.clear_table_non_atomic();
   addrs = stack_traces.get_stack_addr(stack_id);
   REQUIRE(addrs.size() == 0);
@@ -282,3 +292,39 @@ TEST_CASE("test bpf stack_id table", "[bpf_stack_table]") {
   REQUIRE(addrs.size()==0);
 #endif
 }
+
+TEST_CASE("test bpf table after compact", "[bpf_table]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(myhash, int, int, 128);
+    int on_event(void *ctx) {
+      int key = 0, zero = 0;
+      myhash.lookup_or_try_init(&key, &zero);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.code() == 0);
+
+  ebpf::CompactStats stats;
+  bpf.compact(&stats);
+  REQUIRE(stats.image_size > 0);
+  REQUIRE(stats.heap_after <= stats.heap_before);
+
+  int fd;
+  res = bpf.load_func("on_event", BPF_PROG_TYPE_KPROBE, fd);
+  REQUIRE(res.code() == 0);
+  REQUIRE(bpf.unload_func("on_event").code() == 0);
+
+  auto t = bpf.get_hash_table<int, int>("myhash");
+  res = t.update_value(0x08, 0x43);
+  REQUIRE(res.code() == 0);
+  REQUIRE(t[0x08] == 0x43);
+
+  // string conversions went away with the compiler state
+  std::string value;
+  res = bpf.get_table("myhash").get_value("0x8", value);
+  REQUIRE(res.code() != 0);
+}
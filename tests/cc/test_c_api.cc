@@ -24,12 +24,15 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fstream>
+#include <sstream>
 
 #include "bcc_elf.h"
 #include "bcc_perf_map.h"
 #include "bcc_proc.h"
 #include "bcc_syms.h"
 #include "common.h"
+#include "syms.h"
 #include "vendor/tinyformat.hpp"
 
 #include "catch.hpp"
@@ -78,6 +81,139 @@ TEST_CASE("list all kernel symbols", "[c_api]") {
   bcc_procutils_each_ksym(_test_ksym, NULL);
 }
 
+TEST_CASE("resolve kernel module symbols across refreshes", "[c_api]") {
+  if (geteuid() != 0)
+    return;
+
+  // Pick any function of a loaded module, if there is one.
+  std::ifstream kallsyms("/proc/kallsyms");
+  std::string line, name, mod;
+  uint64_t mod_addr = 0;
+  while (std::getline(kallsyms, line)) {
+    std::istringstream is(line);
+    std::string addr, type;
+    if (!(is >> addr >> type >> name >> mod) || (type != "t" && type != "T") ||
+        mod.size() < 3 || mod[0] != '[' || mod == "[bpf]")
+      continue;
+    mod_addr = std::stoull(addr, nullptr, 16);
+    mod = mod.substr(1, mod.size() - 2);
+    break;
+  }
+  if (!mod_addr)
+    return;
+
+  struct bcc_symbol sym;
+  void *resolver = bcc_symcache_new(-1, nullptr);
+  for (int i = 0; i < 2; i++) {
+    REQUIRE(bcc_symcache_resolve(resolver, mod_addr, &sym) == 0);
+    REQUIRE(mod == sym.module);
+    REQUIRE(sym.offset == 0);
+    uint64_t addr;
+    REQUIRE(bcc_symcache_resolve_name(resolver, nullptr, sym.name, &addr) == 0);
+    bcc_symcache_refresh(resolver);
+  }
+  bcc_free_symcache(resolver, -1);
+}
+
+TEST_CASE("splice symbols of loaded and unloaded kernel modules", "[c_api]") {
+  struct FakeKsym {
+    const char *name;
+    const char *mod;
+    uint64_t addr;
+  };
+  std::map<std::string, uint64_t> mods = {{"mod_a", 0xffffffffc0000000ULL}};
+  std::vector<FakeKsym> ksyms = {
+      {"_stext", "kernel", 0xffffffff81000000ULL},
+      {"schedule", "kernel", 0xffffffff81001000ULL},
+      {"a_init", "mod_a", 0xffffffffc0000000ULL},
+      {"a_exit", "mod_a", 0xffffffffc0000100ULL},
+  };
+  KSyms ks([&] { return mods; },
+           [&](bcc_procutils_ksymcb cb, void *payload) {
+             for (auto &s : ksyms)
+               cb(s.name, s.mod, s.addr, payload);
+           });
+
+  struct bcc_symbol sym;
+  uint64_t addr;
+  REQUIRE(ks.resolve_addr(0xffffffffc0000104ULL, &sym));
+  REQUIRE(string("a_exit") == sym.name);
+  REQUIRE(string("mod_a") == sym.module);
+  REQUIRE(sym.offset == 4);
+
+  // Load mod_b between the kernel and mod_a. A kernel symbol showing up
+  // meanwhile must not be read, since only mod_b changed.
+  mods["mod_b"] = 0xffffffffa0000000ULL;
+  ksyms.push_back({"b_init", "mod_b", 0xffffffffa0000000ULL});
+  ksyms.push_back({"b_work", "mod_b", 0xffffffffa0000040ULL});
+  ksyms.push_back({"late_fn", "kernel", 0xffffffff81002000ULL});
+  ks.refresh();
+
+  REQUIRE(ks.resolve_addr(0xffffffffa0000041ULL, &sym));
+  REQUIRE(string("b_work") == sym.name);
+  REQUIRE(string("mod_b") == sym.module);
+  REQUIRE(ks.resolve_name(nullptr, "b_init", &addr));
+  REQUIRE(addr == 0xffffffffa0000000ULL);
+  REQUIRE(!ks.resolve_name(nullptr, "late_fn", &addr));
+  REQUIRE(ks.resolve_addr(0xffffffff81001010ULL, &sym));
+  REQUIRE(string("schedule") == sym.name);
+  REQUIRE(string("kernel") == sym.module);
+  REQUIRE(ks.resolve_addr(0xffffffffc0000104ULL, &sym));
+  REQUIRE(string("a_exit") == sym.name);
+  REQUIRE(string("mod_a") == sym.module);
+
+  // Unload mod_b: its symbols go, the others stay.
+  mods.erase("mod_b");
+  ksyms.resize(4);
+  ks.refresh();
+
+  REQUIRE(!ks.resolve_name(nullptr, "b_init", &addr));
+  REQUIRE(!ks.resolve_name(nullptr, "b_work", &addr));
+  REQUIRE(ks.resolve_addr(0xffffffffa0000041ULL, &sym));
+  REQUIRE(string("schedule") == sym.name);
+  REQUIRE(ks.resolve_name(nullptr, "a_init", &addr));
+  REQUIRE(addr == 0xffffffffc0000000ULL);
+  REQUIRE(ks.resolve_addr(0xffffffffc0000104ULL, &sym));
+  REQUIRE(string("a_exit") == sym.name);
+  REQUIRE(string("mod_a") == sym.module);
+}
+
+TEST_CASE("resolve kernel symbols through the kallsyms snapshot", "[c_api]") {
+  if (geteuid() != 0)
+    return;
+
+  char dir[] = "/tmp/bcc-ksymidx-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+
+  struct bcc_symbol plain_sym, sym;
+  uint64_t addr, plain_addr;
+  void *plain = bcc_symcache_new(-1, nullptr);
+  REQUIRE(bcc_symcache_resolve_name(plain, nullptr, "schedule", &plain_addr) == 0);
+  REQUIRE(bcc_symcache_resolve(plain, plain_addr + 1, &plain_sym) == 0);
+  REQUIRE(string("schedule") == plain_sym.name);
+  REQUIRE(string("kernel") == plain_sym.module);
+
+  setenv("BCC_SYM_INDEX_DIR", dir, 1);
+  // The first cache writes the snapshot, the second one reads it.
+  for (int i = 0; i < 2; i++) {
+    void *resolver = bcc_symcache_new(-1, nullptr);
+    REQUIRE(resolver);
+    REQUIRE(bcc_symcache_resolve_name(resolver, nullptr, "schedule", &addr) == 0);
+    REQUIRE(addr == plain_addr);
+    REQUIRE(bcc_symcache_resolve(resolver, addr + 1, &sym) == 0);
+    REQUIRE(string(plain_sym.name) == sym.name);
+    REQUIRE(string(plain_sym.module) == sym.module);
+    REQUIRE(sym.offset == 1);
+    REQUIRE(bcc_symcache_resolve_name(resolver, nullptr, "no_such_ksym_", &addr) < 0);
+    bcc_free_symcache(resolver, -1);
+  }
+  unsetenv("BCC_SYM_INDEX_DIR");
+  bcc_free_symcache(plain, -1);
+
+  REQUIRE(system(tfm::format("ls %s/kallsyms-*.ksymidx > /dev/null", dir).c_str()) == 0);
+  REQUIRE(system(tfm::format("rm -rf %s", dir).c_str()) == 0);
+}
+
 TEST_CASE("file-backed mapping identification") {
   CHECK(bcc_mapping_is_file_backed("/bin/ls") == 1);
   CHECK(bcc_mapping_is_file_backed("") == 0);
@@ -312,6 +448,115 @@ TEST_CASE("resolve symbol addresses for a given PID", "[c_api]") {
   }
 }
 
+TEST_CASE("resolve repeated and unmapped addresses", "[c_api]") {
+  struct bcc_symbol sym;
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+
+  // Alternate between modules so both the index search and the last-hit
+  // shortcut are exercised.
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) == 0);
+    REQUIRE(string("_a_test_function") == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) == 0);
+    REQUIRE(string("_a_test_function") == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+    REQUIRE(string(sym.module).find("libc") != string::npos);
+  }
+
+  REQUIRE(bcc_symcache_resolve(resolver, 0x10, &sym) < 0);
+  REQUIRE(sym.module == nullptr);
+  bcc_free_symcache(resolver, getpid());
+}
+
+TEST_CASE("refresh symbol cache after loading a library", "[c_api]") {
+  struct bcc_symbol sym;
+  void *resolver = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(resolver);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) == 0);
+  string module = sym.module;
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+  ProcSyms *procsyms = static_cast<ProcSyms *>(resolver);
+  auto libc_table = procsyms->module_table((uint64_t)libc_fptr);
+  REQUIRE(libc_table);
+
+  void *libz = dlopen("libz.so.1", RTLD_NOW);
+  REQUIRE(libz);
+  void *zfunc = dlsym(libz, "zlibVersion");
+  REQUIRE(zfunc);
+
+  bcc_symcache_refresh(resolver);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)zfunc, &sym) == 0);
+  REQUIRE(string("zlibVersion") == sym.name);
+  REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) == 0);
+  REQUIRE(string("_a_test_function") == sym.name);
+  REQUIRE(module == sym.module);
+  // libc did not change, so its module and loaded symbols were kept.
+  REQUIRE(procsyms->module_table((uint64_t)libc_fptr) == libc_table);
+
+  bcc_free_symcache(resolver, getpid());
+  dlclose(libz);
+}
+
+TEST_CASE("symbol caches share module symbol tables", "[c_api]") {
+  struct bcc_symbol sym;
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *first = bcc_symcache_new(getpid(), nullptr);
+  void *second = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(first);
+  REQUIRE(second);
+
+  REQUIRE(bcc_symcache_resolve(first, (uint64_t)libc_fptr, &sym) == 0);
+  string name = sym.name;
+  REQUIRE(bcc_symcache_resolve(second, (uint64_t)&_a_test_function, &sym) == 0);
+  REQUIRE(string("_a_test_function") == sym.name);
+
+  // The table loaded by the first cache must outlive it.
+  bcc_free_symcache(first, getpid());
+  REQUIRE(bcc_symcache_resolve(second, (uint64_t)libc_fptr, &sym) == 0);
+  REQUIRE(name == sym.name);
+  bcc_free_symcache(second, getpid());
+}
+
+TEST_CASE("resolve symbol addresses through the on-disk symbol index", "[c_api]") {
+  char dir[] = "/tmp/bcc-symidx-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+
+  struct bcc_symbol plain_sym, sym;
+  void *libc_fptr = dlsym(NULL, "strtok");
+  REQUIRE(libc_fptr);
+
+  void *plain = bcc_symcache_new(getpid(), nullptr);
+  REQUIRE(bcc_symcache_resolve(plain, (uint64_t)&_a_test_function, &plain_sym) == 0);
+  string exe_name = plain_sym.name;
+  REQUIRE(bcc_symcache_resolve(plain, (uint64_t)libc_fptr, &plain_sym) == 0);
+  string libc_name = plain_sym.name;
+
+  setenv("BCC_SYM_INDEX_DIR", dir, 1);
+  // The first cache builds the indexes, the second one maps them.
+  for (int i = 0; i < 2; i++) {
+    void *resolver = bcc_symcache_new(getpid(), nullptr);
+    REQUIRE(resolver);
+    REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)&_a_test_function, &sym) == 0);
+    REQUIRE(exe_name == sym.name);
+    REQUIRE(bcc_symcache_resolve(resolver, (uint64_t)libc_fptr, &sym) == 0);
+    REQUIRE(libc_name == sym.name);
+    bcc_free_symcache(resolver, getpid());
+  }
+  unsetenv("BCC_SYM_INDEX_DIR");
+  bcc_free_symcache(plain, getpid());
+
+  REQUIRE(system(tfm::format("ls %s/*.symidx > /dev/null", dir).c_str()) == 0);
+  REQUIRE(system(tfm::format("rm -rf %s", dir).c_str()) == 0);
+}
+
 #define STACK_SIZE (1024 * 1024)
 static char child_stack[STACK_SIZE];
 
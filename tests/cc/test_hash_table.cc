@@ -89,6 +89,39 @@ TEST_CASE("test hash table", "[hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("batch operations") {
+    std::vector<std::pair<int, int>> entries;
+    for (int i = 1; i <= 100; i++)
+      entries.emplace_back(i * 3, i);
+
+    // small batch size to exercise multiple batch syscalls
+    res = t.update_batch(entries, 16);
+    REQUIRE(res.code() == 0);
+
+    std::vector<std::pair<int, int>> batch;
+    res = t.get_table_batch(batch, 16);
+    REQUIRE(res.code() == 0);
+    REQUIRE(batch.size() == 100);
+    for (const auto &pair : batch) {
+      REQUIRE(pair.first % 3 == 0);
+      REQUIRE(pair.first / 3 == pair.second);
+    }
+
+    std::vector<int> keys;
+    for (int i = 1; i <= 50; i++)
+      keys.push_back(i * 3);
+    res = t.delete_batch(keys, 16);
+    REQUIRE(res.code() == 0);
+    REQUIRE(t.get_table_offline().size() == 50);
+
+    res = t.lookup_and_delete_batch(batch, 16);
+    REQUIRE(res.code() == 0);
+    REQUIRE(batch.size() == 50);
+    for (const auto &pair : batch)
+      REQUIRE(pair.first / 3 > 50);
+    REQUIRE(t.get_table_offline().size() == 0);
+  }
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
@@ -189,5 +222,29 @@ TEST_CASE("percpu hash table", "[percpu_hash_table]") {
     t.clear_table_non_atomic();
     REQUIRE(t.get_table_offline().size() == 0);
   }
+
+  SECTION("batch operations") {
+    std::vector<std::pair<int, std::vector<uint64_t>>> entries;
+    for (int k = 3; k <= 30; k += 3) {
+      std::vector<uint64_t> v(ncpus);
+      for (size_t cpu = 0; cpu < ncpus; cpu++)
+        v[cpu] = k * cpu;
+      entries.emplace_back(k, v);
+    }
+
+    res = t.update_batch(entries, 4);
+    REQUIRE(res.code() == 0);
+
+    std::vector<std::pair<int, std::vector<uint64_t>>> batch;
+    res = t.lookup_and_delete_batch(batch, 4);
+    REQUIRE(res.code() == 0);
+    REQUIRE(batch.size() == 10);
+    for (const auto &pair : batch) {
+      REQUIRE(pair.second.size() == ncpus);
+      for (size_t cpu = 0; cpu < ncpus; cpu++)
+        REQUIRE(pair.second.at(cpu) == cpu * pair.first);
+    }
+    REQUIRE(t.get_table_offline().size() == 0);
+  }
 }
 #endif
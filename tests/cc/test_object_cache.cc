@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+#include "vendor/tinyformat.hpp"
+
+TEST_CASE("test compiled object cache", "[object_cache]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(counts, int, u64, 128);
+    int on_event(void *ctx) {
+      int key = 1;
+      counts.increment(key);
+      return 0;
+    }
+  )";
+
+  char dir[] = "/tmp/bcc-objcache-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  setenv("BCC_OBJ_CACHE_DIR", dir, 1);
+
+  // Restoring from the cache skips clang altogether.
+  std::atomic<int> parses(0);
+  ebpf::set_phase_callback([&](const ebpf::PhaseStats& s) {
+    if (std::string(s.phase) == "clang.parse")
+      parses++;
+  });
+
+  // The first BPF compiles and fills the cache, the second restores from it.
+  // The third finds the object writable by others and compiles again.
+  for (int i = 0; i < 3; i++) {
+    if (i == 2)
+      REQUIRE(system(tfm::format("chmod 0666 %s/*.bccobj", dir).c_str()) == 0);
+    parses = 0;
+    ebpf::BPF bpf(0, nullptr, false);
+    ebpf::StatusTuple res = bpf.init(BPF_PROGRAM, {"-DCACHE_TEST=1"});
+    REQUIRE(res.code() == 0);
+    REQUIRE(system(tfm::format("ls %s/*.bccobj > /dev/null", dir).c_str()) == 0);
+    REQUIRE((parses == 0) == (i == 1));
+
+    int fd;
+    res = bpf.load_func("on_event", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.code() == 0);
+    REQUIRE(bpf.unload_func("on_event").code() == 0);
+
+    auto counts = bpf.get_hash_table<int, uint64_t>("counts");
+    REQUIRE(counts.update_value(1, 42).code() == 0);
+    uint64_t v;
+    REQUIRE(counts.get_value(1, v).code() == 0);
+    REQUIRE(v == 42);
+  }
+  ebpf::set_phase_callback(nullptr);
+
+  unsetenv("BCC_OBJ_CACHE_DIR");
+  REQUIRE(system(tfm::format("rm -rf %s", dir).c_str()) == 0);
+}
+
+TEST_CASE("test precompiled header", "[object_cache]") {
+  const std::string BPF_PROGRAM1 = R"(
+    BPF_HASH(pids, u32, u64, 128);
+    int on_event(void *ctx) {
+      u32 pid = bpf_get_current_pid_tgid() >> 32;
+      pids.increment(pid);
+      return 0;
+    }
+  )";
+  const std::string BPF_PROGRAM2 = R"(
+    BPF_ARRAY(counts, u64, 4);
+    int on_event(struct pt_regs *ctx) {
+      int key = 0;
+      counts.increment(key);
+      return 0;
+    }
+  )";
+
+  char dir[] = "/tmp/bcc-pch-XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  setenv("BCC_PCH_DIR", dir, 1);
+
+  // Both programs share the cflags, so they share one precompiled header.
+  for (auto &prog : {BPF_PROGRAM1, BPF_PROGRAM2}) {
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res = bpf.init(prog);
+    REQUIRE(res.code() == 0);
+
+    int fd;
+    res = bpf.load_func("on_event", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.code() == 0);
+    REQUIRE(bpf.unload_func("on_event").code() == 0);
+  }
+  REQUIRE(system(tfm::format("test $(ls %s/*.pch | wc -l) -eq 1", dir).c_str()) == 0);
+
+  unsetenv("BCC_PCH_DIR");
+  REQUIRE(system(tfm::format("rm -rf %s", dir).c_str()) == 0);
+}
+
+TEST_CASE("test saved object", "[object_cache]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(counts, int, u64, 128);
+    BPF_PERF_OUTPUT(events);
+    int on_event(void *ctx) {
+      int key = 1;
+      counts.increment(key);
+      events.perf_submit(ctx, &key, sizeof(key));
+      return 0;
+    }
+  )";
+
+  char path[] = "/tmp/bcc-savedobj-XXXXXX";
+  int tmp_fd = mkstemp(path);
+  REQUIRE(tmp_fd >= 0);
+  close(tmp_fd);
+
+  {
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res = bpf.save_object(path, BPF_PROGRAM);
+    REQUIRE(res.code() == 0);
+  }
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res = bpf.load_object(path);
+  REQUIRE(res.code() == 0);
+
+  int fd;
+  res = bpf.load_func("on_event", BPF_PROG_TYPE_KPROBE, fd);
+  REQUIRE(res.code() == 0);
+  REQUIRE(bpf.unload_func("on_event").code() == 0);
+
+  auto counts = bpf.get_hash_table<int, uint64_t>("counts");
+  REQUIRE(counts.update_value(1, 42).code() == 0);
+  uint64_t v;
+  REQUIRE(counts.get_value(1, v).code() == 0);
+  REQUIRE(v == 42);
+
+  // there are no string conversions without the compiler's types
+  std::string value;
+  res = bpf.get_table("counts").get_value("0x1", value);
+  REQUIRE(res.code() != 0);
+
+  // a program can't be loaded twice, nor can a bogus object
+  REQUIRE(bpf.load_object(path).code() != 0);
+  ebpf::BPF bogus;
+  REQUIRE(bogus.load_object("/dev/null").code() != 0);
+
+  unlink(path);
+}
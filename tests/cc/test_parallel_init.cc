@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+TEST_CASE("test parallel init of several programs", "[bpf_init_all]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(counts, int, u64, 128);
+    int on_event(void *ctx) {
+      int key = KEY;
+      counts.increment(key);
+      return 0;
+    }
+  )";
+
+  const int nprogs = 6;
+  std::vector<std::unique_ptr<ebpf::BPF>> owned;
+  std::vector<ebpf::BPF*> bpfs;
+  std::vector<ebpf::BPF::InitSpec> specs;
+  for (int i = 0; i < nprogs; i++) {
+    owned.emplace_back(new ebpf::BPF());
+    bpfs.push_back(owned.back().get());
+    ebpf::BPF::InitSpec spec;
+    spec.program = BPF_PROGRAM;
+    spec.cflags = {"-DKEY=" + std::to_string(i)};
+    spec.funcs = {{"on_event", BPF_PROG_TYPE_KPROBE}};
+    specs.push_back(spec);
+  }
+  // One program fails to compile, without affecting the others.
+  specs[3].program = "int on_event(void *ctx) { return undefined; }";
+
+  auto res = ebpf::BPF::init_all(bpfs, specs, 3);
+  REQUIRE(res.size() == nprogs);
+  for (int i = 0; i < nprogs; i++) {
+    if (i == 3) {
+      REQUIRE(res[i].code() != 0);
+      continue;
+    }
+    REQUIRE(res[i].code() == 0);
+    auto counts = bpfs[i]->get_hash_table<int, uint64_t>("counts");
+    REQUIRE(counts.update_value(i, 1).code() == 0);
+  }
+  // Every program has a table of its own, holding only its own key.
+  for (int i = 0; i < nprogs; i++) {
+    if (i == 3)
+      continue;
+    auto counts = bpfs[i]->get_hash_table<int, uint64_t>("counts");
+    for (int j = 0; j < nprogs; j++) {
+      uint64_t v;
+      REQUIRE((counts.get_value(j, v).code() == 0) == (j == i));
+    }
+  }
+
+  res = ebpf::BPF::init_all(bpfs, {});
+  REQUIRE(res.size() == nprogs);
+  REQUIRE(res[0].code() != 0);
+}
+
+TEST_CASE("test loading all functions of a module", "[bpf_load_all_funcs]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(counts, u64, 4);
+    int on_a(void *ctx) { counts.increment(0); return 0; }
+    int on_b(void *ctx) { counts.increment(1); return 0; }
+    int on_c(void *ctx) { counts.increment(2); return 0; }
+    int skipped(void *ctx) { return 0; }
+  )";
+
+  ebpf::BPF bpf;
+  REQUIRE(bpf.init(BPF_PROGRAM).code() == 0);
+
+  int fd_a;
+  REQUIRE(bpf.load_func("on_a", BPF_PROG_TYPE_KPROBE, fd_a).code() == 0);
+
+  std::vector<ebpf::BPF::FuncLoadInfo> info;
+  auto res = bpf.load_all_funcs(
+      [](const std::string& name) {
+        return name == "skipped" ? BPF_PROG_TYPE_UNSPEC : BPF_PROG_TYPE_KPROBE;
+      },
+      &info, 2);
+  REQUIRE(res.code() == 0);
+  REQUIRE(info.size() == 3);
+  for (auto& load : info) {
+    REQUIRE(load.status.code() == 0);
+    REQUIRE(load.fd >= 0);
+    REQUIRE(load.insn_cnt > 0);
+    int fd;
+    REQUIRE(bpf.load_func(load.name, BPF_PROG_TYPE_KPROBE, fd).code() == 0);
+    REQUIRE(fd == load.fd);
+    if (load.name == "on_a") {
+      REQUIRE(load.fd == fd_a);
+      REQUIRE(load.load_ns == 0);
+    }
+  }
+}
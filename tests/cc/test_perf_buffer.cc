@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+// 104 bytes of payload make 120-byte perf records, which don't divide the
+// ring size, so records keep straddling its end.
+static const std::string BPF_PROGRAM = R"(
+  BPF_PERF_OUTPUT(events);
+
+  struct record {
+    u64 seq;
+    u64 words[12];
+  };
+
+  int on_sys_getuid(void *ctx) {
+    if (bpf_get_current_pid_tgid() >> 32 != TEST_PID)
+      return 0;
+    struct record r = {};
+    r.seq = bpf_ktime_get_ns();
+    #pragma unroll
+    for (int i = 0; i < 12; i++)
+      r.words[i] = r.seq ^ i;
+    events.perf_submit(ctx, &r, sizeof(r));
+    return 0;
+  }
+)";
+
+struct perf_record {
+  uint64_t seq;
+  uint64_t words[12];
+};
+
+struct perf_counts {
+  int samples;
+  int corrupt;
+};
+
+static bool record_intact(const void *data, int size) {
+  struct perf_record r;
+  if (size < (int)sizeof(r))
+    return false;
+  memcpy(&r, data, sizeof(r));
+  for (int i = 0; i < 12; i++)
+    if (r.words[i] != (r.seq ^ i))
+      return false;
+  return true;
+}
+
+static void count_batch(void *cookie, struct perf_reader_raw_sample *samples,
+                        int cnt) {
+  perf_counts *counts = static_cast<perf_counts *>(cookie);
+  for (int i = 0; i < cnt; i++) {
+    counts->samples++;
+    if (!record_intact(samples[i].data, samples[i].size))
+      counts->corrupt++;
+  }
+}
+
+TEST_CASE("test batched perf buffer", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM, {"-DTEST_PID=" + std::to_string(getpid())});
+  REQUIRE(res.code() == 0);
+
+  SECTION("null callback") {
+    res = bpf.open_perf_buffer("events", nullptr);
+    REQUIRE(res.code() == 0);
+    res = bpf.close_perf_buffer("events");
+    REQUIRE(res.code() == 0);
+  }
+
+  SECTION("records wrapping the ring") {
+    perf_counts counts = {};
+    // A single page, so that the records below wrap it many times over.
+    res = bpf.open_perf_buffer_batch("events", count_batch, nullptr, &counts, 1);
+    REQUIRE(res.code() == 0);
+
+    std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+    res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+    REQUIRE(res.code() == 0);
+
+    // Stay below a page per round so nothing is lost.
+    const int rounds = 32, per_round = 16;
+    for (int i = 0; i < rounds; i++) {
+      for (int j = 0; j < per_round; j++)
+        REQUIRE(getuid() >= 0);
+      while (bpf.poll_perf_buffer("events", 0) > 0)
+        ;
+    }
+    res = bpf.detach_kprobe(getuid_fnname);
+    REQUIRE(res.code() == 0);
+    while (bpf.poll_perf_buffer("events", 100) > 0)
+      ;
+
+    REQUIRE(counts.samples == rounds * per_round);
+    REQUIRE(counts.corrupt == 0);
+
+    // The counters add up over every CPU buffer, and nothing got lost.
+    ebpf::BPFPerfBuffer *buffer = bpf.get_perf_buffer("events");
+    REQUIRE(buffer);
+    uint64_t samples = 0, bytes = 0, lost = 0;
+    for (auto &it : buffer->get_stats()) {
+      samples += it.second.samples;
+      bytes += it.second.bytes;
+      lost += it.second.lost;
+    }
+    REQUIRE(samples == (uint64_t)(rounds * per_round));
+    REQUIRE(bytes >= samples * sizeof(perf_record));
+    REQUIRE(lost == 0);
+    res = bpf.close_perf_buffer("events");
+    REQUIRE(res.code() == 0);
+  }
+}
+
+TEST_CASE("test perf buffer poll threads", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM, {"-DTEST_PID=" + std::to_string(getpid())});
+  REQUIRE(res.code() == 0);
+  res = bpf.open_perf_buffer("events", nullptr);
+  REQUIRE(res.code() == 0);
+  ebpf::BPFPerfBuffer *buffer = bpf.get_perf_buffer("events");
+  REQUIRE(buffer);
+
+  // Nothing is attached, so the threads only return from epoll_wait() when
+  // they are stopped.
+  SECTION("stop idle threads waiting without a timeout") {
+    res = buffer->start_poll_threads(2, -1);
+    REQUIRE(res.code() == 0);
+    res = buffer->start_poll_threads(2, -1);
+    REQUIRE(res.code() != 0);
+    res = buffer->stop_poll_threads();
+    REQUIRE(res.code() == 0);
+    // and they can be started again
+    res = buffer->start_poll_threads(1, -1);
+    REQUIRE(res.code() == 0);
+    res = buffer->stop_poll_threads();
+    REQUIRE(res.code() == 0);
+  }
+
+  SECTION("close with idle threads running") {
+    res = buffer->start_poll_threads(2, -1);
+    REQUIRE(res.code() == 0);
+    res = bpf.close_perf_buffer("events");
+    REQUIRE(res.code() == 0);
+  }
+}
+
+static void count_sample(void *cookie, void *data, int size) {
+  static_cast<std::atomic<int> *>(cookie)->fetch_add(1);
+}
+
+TEST_CASE("test perf buffer with batched wakeups", "[perf_buffer]") {
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM, {"-DTEST_PID=" + std::to_string(getpid())});
+  REQUIRE(res.code() == 0);
+
+  // Far fewer samples than the wakeup threshold: they only arrive through
+  // the flush that follows a poll timeout.
+  std::atomic<int> samples(0);
+  res = bpf.open_perf_buffer("events", count_sample, nullptr, &samples, 8,
+                             1000);
+  REQUIRE(res.code() == 0);
+  std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+  res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+  REQUIRE(res.code() == 0);
+
+  SECTION("poll") {
+    for (int i = 0; i < 5; i++)
+      REQUIRE(getuid() >= 0);
+    REQUIRE(bpf.poll_perf_buffer("events", 50) == 0);
+    REQUIRE(samples == 5);
+  }
+
+  SECTION("poll threads") {
+    ebpf::BPFPerfBuffer *buffer = bpf.get_perf_buffer("events");
+    REQUIRE(buffer);
+    res = buffer->start_poll_threads(1, 50);
+    REQUIRE(res.code() == 0);
+    for (int i = 0; i < 5; i++)
+      REQUIRE(getuid() >= 0);
+    for (int i = 0; i < 100 && samples < 5; i++)
+      usleep(10000);
+    REQUIRE(samples == 5);
+    res = buffer->stop_poll_threads();
+    REQUIRE(res.code() == 0);
+  }
+
+  res = bpf.detach_kprobe(getuid_fnname);
+  REQUIRE(res.code() == 0);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+TEST_CASE("test phase stats", "[phase_stats]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_HASH(counts, int, u64, 128);
+    int on_event(void *ctx) {
+      int key = 1;
+      counts.increment(key);
+      return 0;
+    }
+  )";
+
+  std::mutex mutex;
+  std::vector<ebpf::PhaseStats> phases;
+  ebpf::set_phase_callback([&](const ebpf::PhaseStats& s) {
+    std::lock_guard<std::mutex> lock(mutex);
+    phases.push_back(s);
+  });
+
+  {
+    ebpf::BPF bpf;
+    ebpf::StatusTuple res = bpf.init(BPF_PROGRAM);
+    REQUIRE(res.code() == 0);
+    int fd;
+    res = bpf.load_func("on_event", BPF_PROG_TYPE_KPROBE, fd);
+    REQUIRE(res.code() == 0);
+  }
+  ebpf::set_phase_callback(nullptr);
+
+  auto find = [&](const std::string& phase) -> const ebpf::PhaseStats* {
+    for (auto& s : phases)
+      if (phase == s.phase)
+        return &s;
+    return nullptr;
+  };
+
+  // phases nest, and are reported when they end
+  auto parse = find("clang.parse");
+  REQUIRE(parse);
+  REQUIRE(parse->depth == 0);
+  auto pass2 = find("clang.pass2");
+  REQUIRE(pass2);
+  REQUIRE(pass2->depth == 1);
+  REQUIRE(pass2->wall_ns <= parse->wall_ns);
+  REQUIRE(find("finalize"));
+  REQUIRE(find("load_maps"));
+
+  auto load = find("prog_load");
+  REQUIRE(load);
+  REQUIRE(load->name == "on_event");
+  REQUIRE(load->insn_cnt > 0);
+  REQUIRE(load->wall_ns > 0);
+
+  size_t n = phases.size();
+  {
+    ebpf::BPF bpf;
+    REQUIRE(bpf.init(BPF_PROGRAM).code() == 0);
+  }
+  REQUIRE(phases.size() == n);
+}
+
+TEST_CASE("test single pass rewrite fallback", "[phase_stats]") {
+  std::mutex mutex;
+  std::vector<std::string> phases;
+  ebpf::set_phase_callback([&](const ebpf::PhaseStats& s) {
+    std::lock_guard<std::mutex> lock(mutex);
+    phases.push_back(s.phase);
+  });
+  auto ran = [&](const std::string& phase) {
+    for (auto& p : phases)
+      if (p == phase)
+        return true;
+    return false;
+  };
+
+  // The tables a first pass shared are dropped with it, and shared again by
+  // the passes that replace it.
+  const std::string TP_PROGRAM = R"(
+    BPF_TABLE_SHARED("array", int, int, tp_shared, 4);
+    TRACEPOINT_PROBE(syscalls, sys_enter_getuid) {
+      int key = 0;
+      int *v = tp_shared.lookup(&key);
+      if (v)
+        (*v)++;
+      return args->__syscall_nr;
+    }
+  )";
+  ebpf::BPF bpf_tp(0, nullptr, false, "rewrite_fallback");
+  REQUIRE(bpf_tp.init(TP_PROGRAM).code() == 0);
+  REQUIRE(ran("clang.rewrite"));
+  REQUIRE(ran("clang.pass0"));
+
+  phases.clear();
+  ebpf::BPF bpf_extern(0, nullptr, false, "rewrite_fallback");
+  REQUIRE(bpf_extern.init(R"(
+    BPF_TABLE("extern", int, int, tp_shared, 4);
+    int on_event(void *ctx) { return 0; }
+  )").code() == 0);
+  REQUIRE(ran("clang.rewrite"));
+  REQUIRE(!ran("clang.pass0"));
+  int v;
+  auto shared = bpf_extern.get_array_table<int>("tp_shared");
+  REQUIRE(shared.update_value(1, 42).code() == 0);
+  REQUIRE(bpf_tp.get_array_table<int>("tp_shared").get_value(1, v).code() == 0);
+  REQUIRE(v == 42);
+
+  phases.clear();
+  ebpf::BPF bpf_warning;
+  REQUIRE(bpf_warning.init(R"(
+    #warning "diagnosed, so rewritten again"
+    int on_event(void *ctx) { return 0; }
+  )").code() == 0);
+  REQUIRE(ran("clang.rewrite"));
+  REQUIRE(ran("clang.pass0"));
+
+  ebpf::set_phase_callback(nullptr);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2021 Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <linux/version.h>
+#include <unistd.h>
+#include <string>
+
+#include "BPF.h"
+#include "catch.hpp"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+struct ringbuf_counts {
+  int events;
+  int other_events;
+};
+
+static int count_events(void *ctx, void *data, size_t size) {
+  static_cast<ringbuf_counts *>(ctx)->events++;
+  return 0;
+}
+
+static int count_other_events(void *ctx, void *data, size_t size) {
+  static_cast<ringbuf_counts *>(ctx)->other_events++;
+  return 0;
+}
+
+TEST_CASE("test ring buffer", "[ringbuf]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_RINGBUF_OUTPUT(events, 8);
+    BPF_RINGBUF_OUTPUT(other_events, 8);
+    BPF_HASH(myhash, int, int, 1);
+
+    int on_sys_getuid(void *ctx) {
+      u64 ts = bpf_ktime_get_ns();
+      events.ringbuf_output(&ts, sizeof(ts), 0);
+      other_events.ringbuf_output(&ts, sizeof(ts), 0);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::StatusTuple res(0);
+  res = bpf.init(BPF_PROGRAM);
+  REQUIRE(res.code() == 0);
+
+  SECTION("bad table type") {
+    // try to open table of wrong type
+    auto f1 = [&](){
+      bpf.open_ring_buffer("myhash", count_events);
+    };
+
+    REQUIRE_THROWS(f1());
+  }
+
+  SECTION("poll") {
+    ringbuf_counts counts = {};
+    REQUIRE(bpf.poll_ring_buffer(0) == -1);
+
+    res = bpf.open_ring_buffer("events", count_events, &counts);
+    REQUIRE(res.code() == 0);
+    res = bpf.open_ring_buffer("other_events", count_other_events, &counts);
+    REQUIRE(res.code() == 0);
+    // the same map can't be opened twice
+    res = bpf.open_ring_buffer("events", count_events, &counts);
+    REQUIRE(res.code() != 0);
+
+    std::string getuid_fnname = bpf.get_syscall_fnname("getuid");
+    res = bpf.attach_kprobe(getuid_fnname, "on_sys_getuid");
+    REQUIRE(res.code() == 0);
+    REQUIRE(getuid() >= 0);
+    res = bpf.detach_kprobe(getuid_fnname);
+    REQUIRE(res.code() == 0);
+
+    // one poll serves both ring buffers
+    REQUIRE(bpf.poll_ring_buffer(100) >= 2);
+    REQUIRE(counts.events > 0);
+    REQUIRE(counts.other_events > 0);
+    REQUIRE(bpf.consume_ring_buffer() == 0);
+
+    res = bpf.close_ring_buffer();
+    REQUIRE(res.code() == 0);
+    REQUIRE(bpf.get_ring_buffer() == nullptr);
+  }
+}
+#endif
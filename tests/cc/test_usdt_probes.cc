@@ -18,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <sstream>
 
 #include "catch.hpp"
 #include "usdt.h"
@@ -52,6 +53,19 @@ int call_shared_lib_func() {
   return lib_probed_function();
 }
 
+// Sixteen locations of one probe whose argument is read in four ways, as
+// each constant is an immediate operand of its own.
+static void many_probe_sites() {
+#define MANY_SITES_PROBE(n) FOLLY_SDT(libbcc_test, many_sites, (n) % 4)
+  MANY_SITES_PROBE(0); MANY_SITES_PROBE(1); MANY_SITES_PROBE(2);
+  MANY_SITES_PROBE(3); MANY_SITES_PROBE(4); MANY_SITES_PROBE(5);
+  MANY_SITES_PROBE(6); MANY_SITES_PROBE(7); MANY_SITES_PROBE(8);
+  MANY_SITES_PROBE(9); MANY_SITES_PROBE(10); MANY_SITES_PROBE(11);
+  MANY_SITES_PROBE(12); MANY_SITES_PROBE(13); MANY_SITES_PROBE(14);
+  MANY_SITES_PROBE(15);
+#undef MANY_SITES_PROBE
+}
+
 TEST_CASE("test finding a probe in our own process", "[usdt]") {
   USDT::Context ctx(getpid());
   REQUIRE(ctx.num_probes() >= 1);
@@ -74,6 +88,122 @@ TEST_CASE("test finding a probe in our own process", "[usdt]") {
   }
 }
 
+TEST_CASE("test probes found again from cached notes", "[usdt]") {
+  // The second context gets its probe notes from the cache the first filled.
+  USDT::Context first(getpid());
+  USDT::Context second(getpid());
+  REQUIRE(first.num_probes() >= 1);
+  REQUIRE(second.num_probes() == first.num_probes());
+
+  for (size_t i = 0; i < first.num_probes(); i++) {
+    USDT::Probe *a = first.get(i);
+    USDT::Probe *b = second.get(a->provider(), a->name());
+    REQUIRE(b);
+    REQUIRE(b->bin_path() == a->bin_path());
+    REQUIRE(b->semaphore() == a->semaphore());
+    REQUIRE(b->num_locations() == a->num_locations());
+    REQUIRE(b->num_arguments() == a->num_arguments());
+    for (size_t j = 0; j < a->num_locations(); j++)
+      REQUIRE(b->address(j) == a->address(j));
+  }
+}
+
+TEST_CASE("test looking up probes by provider and name", "[usdt]") {
+  USDT::Context ctx(getpid());
+  REQUIRE(ctx.num_probes() >= 1);
+
+  for (size_t i = 0; i < ctx.num_probes(); i++) {
+    USDT::Probe *probe = ctx.get(i);
+    REQUIRE(ctx.get(probe->provider(), probe->name()) == probe);
+    REQUIRE(ctx.get(probe->name()) != nullptr);
+    REQUIRE(ctx.get(probe->name())->name() == probe->name());
+    for (size_t j = 1; j < probe->num_locations(); j++) {
+      std::string prev = probe->location_bin_path(j - 1);
+      std::string cur = probe->location_bin_path(j);
+      REQUIRE((prev < cur || (prev == cur && probe->address(j - 1) < probe->address(j))));
+    }
+  }
+  REQUIRE(ctx.get("libbcc_test", "no_such_probe") == nullptr);
+  REQUIRE(ctx.get("no_such_probe") == nullptr);
+}
+
+TEST_CASE("test grouping argument layouts of probe locations", "[usdt]") {
+  many_probe_sites();
+  USDT::Context ctx(getpid());
+  USDT::Probe *probe = ctx.get("libbcc_test", "many_sites");
+  REQUIRE(probe);
+  REQUIRE(probe->num_locations() == USDT::USDT_LOCATION_TABLE_MIN);
+
+  SECTION("switching on the IP") {
+    std::ostringstream stream;
+    REQUIRE(probe->usdt_getarg(stream, "on_many_sites"));
+    REQUIRE(!probe->has_location_table());
+    std::string text = stream.str();
+    REQUIRE(text.find("switch(PT_REGS_IP(ctx))") != std::string::npos);
+
+    size_t reads = 0;
+    for (size_t pos = text.find("return 0;"); pos != std::string::npos;
+         pos = text.find("return 0;", pos + 1))
+      reads++;
+    REQUIRE(reads == 4);
+  }
+
+  SECTION("looking up the location in a table") {
+    std::ostringstream stream;
+    REQUIRE(probe->usdt_getarg(stream, "on_many_sites", true));
+    REQUIRE(probe->has_location_table());
+    REQUIRE(probe->location_table_name() == "__usdt_loc_on_many_sites");
+    std::string text = stream.str();
+    REQUIRE(text.find("BPF_HASH(__usdt_loc_on_many_sites, u64, u32, 16);") !=
+            std::string::npos);
+    REQUIRE(text.find("switch(PT_REGS_IP(ctx))") == std::string::npos);
+    // Only the shared group helper looks up the table.
+    size_t lookup = text.find("__usdt_loc_on_many_sites.lookup(");
+    REQUIRE(lookup != std::string::npos);
+    REQUIRE(text.find("__usdt_loc_on_many_sites.lookup(", lookup + 1) ==
+            std::string::npos);
+    REQUIRE(text.find("switch(_bpf_usdt_group_on_many_sites(ctx))") !=
+            std::string::npos);
+    REQUIRE(text.find("case 3:") != std::string::npos);
+    REQUIRE(text.find("case 4:") == std::string::npos);
+  }
+}
+
+TEST_CASE("test reading arguments through a location table", "[usdt]") {
+  const std::string BPF_PROGRAM = R"(
+    BPF_ARRAY(seen, u64, 4);
+    int on_many_sites(struct pt_regs *ctx) {
+      int arg = -1;
+      if (bpf_usdt_readarg(1, ctx, &arg) == 0 && arg >= 0 && arg < 4)
+        seen.increment(arg);
+      return 0;
+    }
+  )";
+
+  ebpf::BPF bpf;
+  ebpf::USDT u(::getpid(), "libbcc_test", "many_sites", "on_many_sites");
+  auto res = bpf.init(BPF_PROGRAM, {}, {u});
+  REQUIRE(res.code() == 0);
+
+  auto locations =
+      bpf.get_hash_table<uint64_t, uint32_t>("__usdt_loc_on_many_sites");
+  REQUIRE(locations.get_table_offline().size() == USDT::USDT_LOCATION_TABLE_MIN);
+
+  res = bpf.attach_usdt(u);
+  REQUIRE(res.code() == 0);
+  many_probe_sites();
+  res = bpf.detach_usdt(u);
+  REQUIRE(res.code() == 0);
+
+  // Every value is passed at four of the sixteen sites.
+  auto seen = bpf.get_array_table<uint64_t>("seen");
+  for (int i = 0; i < 4; i++) {
+    uint64_t v;
+    REQUIRE(seen.get_value(i, v).code() == 0);
+    REQUIRE(v == 4);
+  }
+}
+
 TEST_CASE("test probe's attributes with C++ API", "[usdt]") {
     const ebpf::USDT u("/proc/self/exe", "libbcc_test", "sample_probe_1", "on_event");
 